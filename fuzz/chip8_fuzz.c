@@ -0,0 +1,618 @@
+#include "chip8.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+Coverage-guided fuzzing harness for the core.
+
+`make chip8_fuzz` builds it with its own small driver (below) and any
+compiler. `make chip8_libfuzzer` builds the same entry point under clang's
+libFuzzer and AddressSanitizer.
+
+An input is a ROM followed by keypad events. The first two bytes are the ROM
+length (big-endian, clamped to what's left), then the ROM itself. If
+CHIP8_FUZZ_ROM names a ROM file, that ROM is loaded once instead and the
+whole input is events.
+
+Each event is two bytes: how many frames to run first (mod
+FUZZ_MAX_EVENT_WAIT), then the key to flip (low nibble). After the last
+event the machine runs until FUZZ_MAX_FRAMES frames in all.
+
+Once the keys stop changing, halt detection is on. If the machine is still
+running when the frames run out, it gets up to FUZZ_HANG_SECONDS more for its
+state to repeat. A machine that halts either way is stuck for good, and a
+ROM stuck at a PC no input has been stuck at before is a hang: the
+standalone driver saves it, and libFuzzer aborts on it if
+CHIP8_FUZZ_ABORT_ON_HANG is set.
+
+Coverage feedback is pc_coverage, the per-PC execution counters the core
+bumps when built with CHIP8_COVERAGE. Under libFuzzer they go in its extra
+counters section. Every input starts from the same machine, restored from a
+snapshot with memcpy.
+*/
+
+#define FUZZ_MAX_FRAMES 60
+#define FUZZ_MAX_EVENT_WAIT 16
+#define FUZZ_MAX_INPUT_SIZE 4096
+#define FUZZ_HANG_SECONDS 1
+
+#if defined(CHIP8_LIBFUZZER) && defined(__linux__)
+__attribute__((section("__libfuzzer_extra_counters")))
+#endif
+uint8_t pc_coverage[RAM_SIZE];
+
+static MachineSnapshot boot_snapshot;
+static bool fixed_rom = false;
+static bool abort_on_hang = false;
+
+// The PCs inputs have hung at so far, and whether the last input was a new one
+static bool seen_hang_pcs[RAM_SIZE];
+static bool input_hung = false;
+static uint64_t hang_count = 0;
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+  (void)argc;
+  (void)argv;
+
+  init_ram();
+
+  char *rom = getenv("CHIP8_FUZZ_ROM");
+  if (rom != NULL)
+  {
+    if (load_rom_to_ram(rom) != 0)
+    {
+      exit(EXIT_FAILURE);
+    }
+    fixed_rom = true;
+  }
+  abort_on_hang = getenv("CHIP8_FUZZ_ABORT_ON_HANG") != NULL;
+
+  save_machine(&boot_snapshot);
+  return 0;
+}
+
+/*
+Runs on after the frame budget, for as long as the state hashes need to
+catch a repeat, and records a hang if the machine turns out to be stuck at a
+new PC.
+*/
+static void check_for_hang(int frame)
+{
+  int end_frame = frame + FUZZ_HANG_SECONDS * TIMER_HZ;
+
+  while (frame < end_frame && !machine_halted && machine_fault == FAULT_NONE)
+  {
+    run_frame();
+    frame++;
+  }
+
+  if (machine_halted && !seen_hang_pcs[halt_pc])
+  {
+    seen_hang_pcs[halt_pc] = true;
+    input_hung = true;
+    hang_count++;
+  }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  restore_machine(&boot_snapshot);
+  halt_detection = false;
+  input_hung = false;
+
+  if (!fixed_rom)
+  {
+    if (size < 2)
+    {
+      return 0;
+    }
+
+    size_t rom_size = (data[0] << 8) | data[1];
+    data += 2;
+    size -= 2;
+
+    if (rom_size > size)
+    {
+      rom_size = size;
+    }
+    if (rom_size > RAM_SIZE - ROM_START_ADDRESS)
+    {
+      rom_size = RAM_SIZE - ROM_START_ADDRESS;
+    }
+
+    memcpy(&ram[ROM_START_ADDRESS], data, rom_size);
+    data += rom_size;
+    size -= rom_size;
+  }
+
+  int frame = 0;
+
+  for (size_t i = 0; i + 1 < size && frame < FUZZ_MAX_FRAMES; i += 2)
+  {
+    for (int wait = data[i] % FUZZ_MAX_EVENT_WAIT; wait > 0 && frame < FUZZ_MAX_FRAMES; wait--)
+    {
+      run_frame();
+      frame++;
+    }
+
+    keypad ^= 1 << (data[i + 1] & 0xF);
+  }
+
+  // No more key presses can wake it up from here
+  halt_detection = true;
+
+  // A fault or halt stops the machine for good, so there's nothing left to cover
+  while (frame < FUZZ_MAX_FRAMES && !machine_halted && machine_fault == FAULT_NONE)
+  {
+    run_frame();
+    frame++;
+  }
+
+  if (machine_fault == FAULT_NONE)
+  {
+    check_for_hang(frame);
+  }
+
+  if (input_hung && abort_on_hang)
+  {
+    fprintf(stderr, "chip8_fuzz: hang at 0x%03X\n", halt_pc);
+    abort();
+  }
+
+  return 0;
+}
+
+#ifndef CHIP8_LIBFUZZER
+
+/*
+The standalone driver: keeps a corpus in memory, mutates random entries and
+keeps every mutant that reaches a new (PC, hit count bucket) pair, AFL style.
+
+Usage: chip8_fuzz [-runs=N] [-max_total_time=S] [CORPUS_DIR] [SEED...]
+
+New corpus entries are written to CORPUS_DIR if given. An input that crashes
+the emulator is written to crash-<execution>, one that takes over a second to
+run to timeout-<execution>, and one that leaves the ROM stuck at a new PC to
+hang-<execution>.
+*/
+
+typedef struct
+{
+  uint8_t *data;
+  size_t size;
+} FuzzInput;
+
+static FuzzInput *corpus = NULL;
+static size_t corpus_size = 0;
+static size_t corpus_capacity = 0;
+
+// One bit per hit count bucket seen so far, per PC
+static uint8_t seen_buckets[RAM_SIZE];
+
+static uint8_t current_input[FUZZ_MAX_INPUT_SIZE];
+static size_t current_size = 0;
+static volatile sig_atomic_t running_input = 0;
+static volatile uint64_t executions = 0;
+static uint64_t executions_at_last_alarm = 0;
+
+static uint64_t random_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t next_random(void)
+{
+  // xorshift64
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+static size_t random_below(size_t limit)
+{
+  return limit == 0 ? 0 : next_random() % limit;
+}
+
+/*
+Writes the input being run to prefix-<execution>. Only uses async-signal-safe
+calls, since it also runs from signal handlers.
+*/
+static void save_current_input(const char *prefix)
+{
+  char name[64];
+  size_t length = strlen(prefix);
+  uint64_t number = executions;
+  char digits[24];
+  int digit_count = 0;
+
+  memcpy(name, prefix, length);
+  name[length++] = '-';
+  do
+  {
+    digits[digit_count++] = '0' + number % 10;
+    number /= 10;
+  } while (number > 0);
+  while (digit_count > 0)
+  {
+    name[length++] = digits[--digit_count];
+  }
+  name[length] = '\0';
+
+  int file = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file >= 0)
+  {
+    write(file, current_input, current_size);
+    close(file);
+  }
+
+  const char *message = "chip8_fuzz: saved input to ";
+  write(STDERR_FILENO, message, strlen(message));
+  write(STDERR_FILENO, name, length);
+  write(STDERR_FILENO, "\n", 1);
+}
+
+static void crash_handler(int signal_number)
+{
+  if (running_input)
+  {
+    running_input = 0;
+    save_current_input("crash");
+  }
+
+  signal(signal_number, SIG_DFL);
+  raise(signal_number);
+}
+
+/*
+Fires every second. If the input that was running a second ago is still
+running, it's a hang.
+*/
+static void alarm_handler(int signal_number)
+{
+  (void)signal_number;
+
+  if (running_input && executions == executions_at_last_alarm)
+  {
+    running_input = 0;
+    save_current_input("timeout");
+    _exit(EXIT_FAILURE);
+  }
+
+  executions_at_last_alarm = executions;
+}
+
+/*
+Bad ROMs fault and stop instead of exiting, so anything that exits mid-run
+is a bug in the core. Save it like a crash.
+*/
+static void exit_handler(void)
+{
+  if (running_input)
+  {
+    running_input = 0;
+    save_current_input("crash");
+  }
+}
+
+static void add_to_corpus(const uint8_t *data, size_t size)
+{
+  if (corpus_size == corpus_capacity)
+  {
+    corpus_capacity = corpus_capacity == 0 ? 64 : corpus_capacity * 2;
+    corpus = realloc(corpus, corpus_capacity * sizeof corpus[0]);
+    if (corpus == NULL)
+    {
+      perror("Failed growing the corpus");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  FuzzInput *input = &corpus[corpus_size++];
+  input->data = malloc(size > 0 ? size : 1);
+  input->size = size;
+  memcpy(input->data, data, size);
+}
+
+/*
+Maps a hit count to a one-bit bucket: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+.
+Filled in by fill_hit_count_buckets.
+*/
+static uint8_t hit_count_buckets[256];
+
+static void fill_hit_count_buckets(void)
+{
+  for (int count = 1; count < 256; count++)
+  {
+    int bucket = count <= 3 ? count - 1 : count <= 7 ? 3 : count <= 15 ? 4 : count <= 31 ? 5 : count <= 127 ? 6 : 7;
+    hit_count_buckets[count] = 1 << bucket;
+  }
+}
+
+/*
+Runs current_input and returns the number of PCs covered, or 0 if nothing
+new was reached.
+*/
+static int run_current_input(void)
+{
+  memset(pc_coverage, 0, sizeof pc_coverage);
+
+  running_input = 1;
+  LLVMFuzzerTestOneInput(current_input, current_size);
+  running_input = 0;
+  executions++;
+
+  if (input_hung)
+  {
+    save_current_input("hang");
+  }
+
+  bool found_new = false;
+  int covered = 0;
+
+  // Most of RAM never runs, so skip it eight counters at a time
+  for (int block = 0; block < RAM_SIZE; block += 8)
+  {
+    uint64_t counters;
+    memcpy(&counters, &pc_coverage[block], sizeof counters);
+
+    if (counters == 0)
+    {
+      continue;
+    }
+
+    for (int address = block; address < block + 8; address++)
+    {
+      uint8_t bucket = hit_count_buckets[pc_coverage[address]];
+
+      if (bucket & ~seen_buckets[address])
+      {
+        seen_buckets[address] |= bucket;
+        found_new = true;
+      }
+    }
+  }
+
+  if (!found_new)
+  {
+    return 0;
+  }
+
+  for (int address = 0; address < RAM_SIZE; address++)
+  {
+    covered += seen_buckets[address] != 0;
+  }
+  return covered;
+}
+
+/*
+Applies one to four random edits to current_input.
+*/
+static void mutate_current_input(void)
+{
+  int edits = 1 + random_below(4);
+
+  for (int edit = 0; edit < edits; edit++)
+  {
+    size_t position = random_below(current_size);
+
+    switch (random_below(6))
+    {
+    case 0:
+      // Flip a bit
+      if (current_size > 0)
+      {
+        current_input[position] ^= 1 << random_below(8);
+      }
+      break;
+
+    case 1:
+      // Random byte
+      if (current_size > 0)
+      {
+        current_input[position] = next_random();
+      }
+      break;
+
+    case 2:
+      // Insert a random byte
+      if (current_size < FUZZ_MAX_INPUT_SIZE)
+      {
+        position = random_below(current_size + 1);
+        memmove(&current_input[position + 1], &current_input[position], current_size - position);
+        current_input[position] = next_random();
+        current_size++;
+      }
+      break;
+
+    case 3:
+      // Erase a byte
+      if (current_size > 0)
+      {
+        memmove(&current_input[position], &current_input[position + 1], current_size - position - 1);
+        current_size--;
+      }
+      break;
+
+    case 4:
+      // Nudge a byte up or down a little, e.g. to move an address or a count
+      if (current_size > 0)
+      {
+        current_input[position] += (int)random_below(33) - 16;
+      }
+      break;
+
+    case 5:
+    {
+      // Overwrite with a chunk of another corpus entry
+      const FuzzInput *other = &corpus[random_below(corpus_size)];
+      if (other->size > 0 && current_size > 0)
+      {
+        size_t from = random_below(other->size);
+        size_t length = 1 + random_below(other->size - from);
+        if (length > current_size - position)
+        {
+          length = current_size - position;
+        }
+        memcpy(&current_input[position], &other->data[from], length);
+      }
+      break;
+    }
+    }
+  }
+}
+
+/*
+Reads a seed file into the corpus. Files that are too large get truncated.
+*/
+static void load_seed(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    return;
+  }
+
+  current_size = fread(current_input, 1, FUZZ_MAX_INPUT_SIZE, file);
+  fclose(file);
+
+  run_current_input();
+  add_to_corpus(current_input, current_size);
+}
+
+static void save_to_corpus_dir(const char *directory)
+{
+  char path[4096];
+  snprintf(path, sizeof path, "%s/input-%llu", directory, (unsigned long long)executions);
+
+  FILE *file = fopen(path, "wb");
+  if (file != NULL)
+  {
+    fwrite(current_input, 1, current_size, file);
+    fclose(file);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t max_runs = 0;
+  double max_seconds = 0;
+  const char *corpus_directory = NULL;
+
+  LLVMFuzzerInitialize(&argc, &argv);
+  fill_hit_count_buckets();
+
+  signal(SIGSEGV, crash_handler);
+  signal(SIGBUS, crash_handler);
+  signal(SIGFPE, crash_handler);
+  signal(SIGILL, crash_handler);
+  signal(SIGABRT, crash_handler);
+  signal(SIGALRM, alarm_handler);
+  atexit(exit_handler);
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strncmp(argv[i], "-runs=", 6) == 0)
+    {
+      max_runs = strtoull(argv[i] + 6, NULL, 10);
+    }
+    else if (strncmp(argv[i], "-max_total_time=", 16) == 0)
+    {
+      max_seconds = atof(argv[i] + 16);
+    }
+    else
+    {
+      DIR *directory = opendir(argv[i]);
+
+      if (directory == NULL)
+      {
+        load_seed(argv[i]);
+        continue;
+      }
+
+      if (corpus_directory == NULL)
+      {
+        corpus_directory = argv[i];
+      }
+
+      struct dirent *entry;
+      while ((entry = readdir(directory)) != NULL)
+      {
+        char path[4096];
+        if (entry->d_name[0] != '.')
+        {
+          snprintf(path, sizeof path, "%s/%s", argv[i], entry->d_name);
+          load_seed(path);
+        }
+      }
+      closedir(directory);
+    }
+  }
+
+  if (corpus_size == 0)
+  {
+    current_size = 0;
+    run_current_input();
+    add_to_corpus(current_input, 0);
+  }
+
+  struct itimerval watchdog = {{1, 0}, {1, 0}};
+  setitimer(ITIMER_REAL, &watchdog, NULL);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  double last_report = 0;
+
+  printf("chip8_fuzz: %zu inputs in the corpus, %s\n", corpus_size,
+         fixed_rom ? "fuzzing keypad events" : "fuzzing ROMs and keypad events");
+
+  while (max_runs == 0 || executions < max_runs)
+  {
+    const FuzzInput *parent = &corpus[random_below(corpus_size)];
+    memcpy(current_input, parent->data, parent->size);
+    current_size = parent->size;
+    mutate_current_input();
+
+    int covered = run_current_input();
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (covered > 0)
+    {
+      add_to_corpus(current_input, current_size);
+      if (corpus_directory != NULL)
+      {
+        save_to_corpus_dir(corpus_directory);
+      }
+      printf("#%llu NEW cov: %d corp: %zu exec/s: %.0f\n", (unsigned long long)executions, covered,
+             corpus_size, executions / elapsed);
+    }
+
+    if (elapsed - last_report >= 1)
+    {
+      printf("#%llu pulse corp: %zu hangs: %llu exec/s: %.0f\n", (unsigned long long)executions, corpus_size,
+             (unsigned long long)hang_count, executions / elapsed);
+      last_report = elapsed;
+    }
+
+    if (max_seconds > 0 && elapsed >= max_seconds)
+    {
+      break;
+    }
+  }
+
+  printf("chip8_fuzz: done after %llu executions, %llu hangs\n", (unsigned long long)executions,
+         (unsigned long long)hang_count);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,203 @@
+#include "libchip8.h"
+#include "chip8.h"
+#include <stdlib.h>
+
+/*
+libchip8, a thin layer over the core. The machine lives in the core's
+globals, so a Chip8 is only a handle saying it's been created, and the
+snapshots are the core's own MachineSnapshot.
+*/
+
+struct Chip8
+{
+  bool in_use;
+};
+
+struct Chip8Snapshot
+{
+  MachineSnapshot machine;
+};
+
+static Chip8 the_machine;
+// The machine as it is right after init_ram, for resets
+static MachineSnapshot boot_snapshot;
+static bool boot_snapshot_taken = false;
+
+Chip8 *chip8_create(void)
+{
+  if (the_machine.in_use)
+  {
+    return NULL;
+  }
+
+  if (!boot_snapshot_taken)
+  {
+    init_ram();
+    save_machine(&boot_snapshot);
+    boot_snapshot_taken = true;
+  }
+
+  the_machine.in_use = true;
+  chip8_reset(&the_machine);
+  return &the_machine;
+}
+
+void chip8_destroy(Chip8 *machine)
+{
+  machine->in_use = false;
+}
+
+void chip8_reset(Chip8 *machine)
+{
+  (void)machine;
+  restore_machine(&boot_snapshot);
+}
+
+int chip8_load_rom(Chip8 *machine, const char *path)
+{
+  chip8_reset(machine);
+  return load_rom_to_ram((char *)path);
+}
+
+int chip8_load_rom_bytes(Chip8 *machine, const uint8_t *rom, size_t size)
+{
+  chip8_reset(machine);
+  return load_rom_from_memory(rom, size);
+}
+
+void chip8_set_keys(Chip8 *machine, uint16_t keys)
+{
+  (void)machine;
+  keypad = keys;
+}
+
+uint64_t chip8_step(Chip8 *machine, uint64_t cycles)
+{
+  (void)machine;
+  uint64_t start_cycle = cycle_count;
+
+  run_cycles(cycles);
+  return cycle_count - start_cycle;
+}
+
+uint32_t chip8_run_frames(Chip8 *machine, const uint16_t *keys, uint32_t frame_count)
+{
+  uint32_t frame = 0;
+
+  while (frame < frame_count && chip8_status(machine) == CHIP8_RUNNING)
+  {
+    if (keys != NULL)
+    {
+      keypad = keys[frame];
+    }
+
+    run_frame();
+    frame++;
+  }
+
+  return frame;
+}
+
+void chip8_set_halt_detection(Chip8 *machine, bool enabled)
+{
+  (void)machine;
+  halt_detection = enabled;
+}
+
+uint8_t *chip8_ram(Chip8 *machine)
+{
+  (void)machine;
+  return ram;
+}
+
+const uint8_t *chip8_framebuffer(Chip8 *machine)
+{
+  (void)machine;
+  return (const uint8_t *)pixels;
+}
+
+uint8_t *chip8_registers(Chip8 *machine)
+{
+  (void)machine;
+  return registers;
+}
+
+uint16_t chip8_pc(Chip8 *machine)
+{
+  (void)machine;
+  return pc;
+}
+
+uint16_t chip8_index(Chip8 *machine)
+{
+  (void)machine;
+  return I;
+}
+
+uint8_t chip8_delay_timer(Chip8 *machine)
+{
+  (void)machine;
+  return delay_timer;
+}
+
+uint8_t chip8_sound_timer(Chip8 *machine)
+{
+  (void)machine;
+  return sound_timer;
+}
+
+uint64_t chip8_cycle_count(Chip8 *machine)
+{
+  (void)machine;
+  return cycle_count;
+}
+
+Chip8Status chip8_status(Chip8 *machine)
+{
+  (void)machine;
+
+  if (machine_fault != FAULT_NONE)
+  {
+    return CHIP8_FAULTED;
+  }
+  if (machine_halted)
+  {
+    return CHIP8_HALTED;
+  }
+  return CHIP8_RUNNING;
+}
+
+const char *chip8_fault(Chip8 *machine)
+{
+  (void)machine;
+  return fault_description(machine_fault);
+}
+
+uint16_t chip8_halt_pc(Chip8 *machine)
+{
+  (void)machine;
+  return halt_pc;
+}
+
+Chip8Snapshot *chip8_snapshot_save(Chip8 *machine)
+{
+  (void)machine;
+  Chip8Snapshot *snapshot = malloc(sizeof *snapshot);
+
+  if (snapshot != NULL)
+  {
+    save_machine(&snapshot->machine);
+  }
+  return snapshot;
+}
+
+void chip8_snapshot_restore(Chip8 *machine, const Chip8Snapshot *snapshot)
+{
+  (void)machine;
+  restore_machine(&snapshot->machine);
+}
+
+void chip8_snapshot_free(Chip8Snapshot *snapshot)
+{
+  free(snapshot);
+}
@@ -0,0 +1,87 @@
+#ifndef LIBCHIP8_H
+#define LIBCHIP8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+C API of libchip8, the emulator core without a window, for driving it from
+other programs and languages (see python/chip8.py).
+
+The core keeps the machine in globals, so there can only be one Chip8 per
+process at a time. Use a process per machine to run several side by side,
+and snapshots to go back to a known state within one.
+
+The pointers returned by chip8_ram, chip8_framebuffer and chip8_registers
+point straight at the machine, so reading them costs no copy and always
+shows the current state. They stay valid until chip8_destroy.
+*/
+
+#if defined(__GNUC__)
+#define CHIP8_API __attribute__((visibility("default")))
+#else
+#define CHIP8_API
+#endif
+
+#define CHIP8_RAM_SIZE 4096
+#define CHIP8_SCREEN_WIDTH 64
+#define CHIP8_SCREEN_HEIGHT 32
+
+typedef struct Chip8 Chip8;
+typedef struct Chip8Snapshot Chip8Snapshot;
+
+typedef enum
+{
+  CHIP8_RUNNING,
+  // The ROM did something the machine can't carry on from, see chip8_fault
+  CHIP8_FAULTED,
+  // Halt detection found the ROM can't do anything new, see chip8_halt_pc
+  CHIP8_HALTED,
+} Chip8Status;
+
+/*
+Creating and loading. chip8_create returns NULL if a machine already exists.
+Loading a ROM resets the machine first. Both loads return 0 on success.
+*/
+CHIP8_API Chip8 *chip8_create(void);
+CHIP8_API void chip8_destroy(Chip8 *machine);
+CHIP8_API void chip8_reset(Chip8 *machine);
+CHIP8_API int chip8_load_rom(Chip8 *machine, const char *path);
+CHIP8_API int chip8_load_rom_bytes(Chip8 *machine, const uint8_t *rom, size_t size);
+
+/*
+Running. chip8_step runs the given number of cycles and returns how many
+ran, which is fewer if the machine stopped. chip8_run_frames runs up to
+frame_count 60 Hz frames, holding keys[i] (bit n for key n) during frame i,
+and returns how many frames ran.
+*/
+CHIP8_API void chip8_set_keys(Chip8 *machine, uint16_t keys);
+CHIP8_API uint64_t chip8_step(Chip8 *machine, uint64_t cycles);
+CHIP8_API uint32_t chip8_run_frames(Chip8 *machine, const uint16_t *keys, uint32_t frame_count);
+CHIP8_API void chip8_set_halt_detection(Chip8 *machine, bool enabled);
+
+/*
+The machine's state. The framebuffer is one byte per pixel, 0 or 1, row by
+row.
+*/
+CHIP8_API uint8_t *chip8_ram(Chip8 *machine);
+CHIP8_API const uint8_t *chip8_framebuffer(Chip8 *machine);
+CHIP8_API uint8_t *chip8_registers(Chip8 *machine);
+CHIP8_API uint16_t chip8_pc(Chip8 *machine);
+CHIP8_API uint16_t chip8_index(Chip8 *machine);
+CHIP8_API uint8_t chip8_delay_timer(Chip8 *machine);
+CHIP8_API uint8_t chip8_sound_timer(Chip8 *machine);
+CHIP8_API uint64_t chip8_cycle_count(Chip8 *machine);
+CHIP8_API Chip8Status chip8_status(Chip8 *machine);
+CHIP8_API const char *chip8_fault(Chip8 *machine);
+CHIP8_API uint16_t chip8_halt_pc(Chip8 *machine);
+
+/*
+Snapshots of the whole machine. Restoring one is a few memcpys.
+*/
+CHIP8_API Chip8Snapshot *chip8_snapshot_save(Chip8 *machine);
+CHIP8_API void chip8_snapshot_restore(Chip8 *machine, const Chip8Snapshot *snapshot);
+CHIP8_API void chip8_snapshot_free(Chip8Snapshot *snapshot);
+
+#endif
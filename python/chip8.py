@@ -0,0 +1,217 @@
+"""Python bindings for libchip8 (`make libchip8.so`), using ctypes.
+
+    import chip8
+
+    machine = chip8.Machine()
+    machine.load_rom("game.ch8")
+    machine.run_frames([0] * 60)       # one second with no keys held
+    screen = machine.framebuffer       # 32x64 view of the pixels, no copy
+    start = machine.snapshot()
+    ...
+    machine.restore(start)
+
+The framebuffer, RAM and registers are views straight into the emulator's
+memory: they always show the current state and reading them copies nothing.
+They're memoryviews, or NumPy arrays when NumPy is installed.
+
+run_frames takes the keys held for each frame and runs them all in one
+call, so an agent crosses into C once per batch rather than once per
+instruction or frame.
+
+The core keeps its state in globals, so there is one Machine per process.
+Use a process per machine to run several at once.
+
+The library is looked for in $CHIP8_LIB, then next to this file, then in
+the repository root.
+"""
+
+import ctypes
+import os
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+RAM_SIZE = 4096
+SCREEN_WIDTH = 64
+SCREEN_HEIGHT = 32
+
+RUNNING, FAULTED, HALTED = 0, 1, 2
+
+
+def _load_library():
+    here = os.path.dirname(os.path.abspath(__file__))
+    candidates = [
+        os.environ.get("CHIP8_LIB"),
+        os.path.join(here, "libchip8.so"),
+        os.path.join(here, "..", "libchip8.so"),
+    ]
+
+    for path in candidates:
+        if path and os.path.exists(path):
+            return ctypes.CDLL(path)
+
+    raise OSError("libchip8.so not found, build it with `make libchip8.so` or set CHIP8_LIB")
+
+
+_lib = _load_library()
+
+_functions = {
+    "chip8_create": (ctypes.c_void_p, []),
+    "chip8_destroy": (None, [ctypes.c_void_p]),
+    "chip8_reset": (None, [ctypes.c_void_p]),
+    "chip8_load_rom": (ctypes.c_int, [ctypes.c_void_p, ctypes.c_char_p]),
+    "chip8_load_rom_bytes": (ctypes.c_int, [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]),
+    "chip8_set_keys": (None, [ctypes.c_void_p, ctypes.c_uint16]),
+    "chip8_step": (ctypes.c_uint64, [ctypes.c_void_p, ctypes.c_uint64]),
+    "chip8_run_frames": (ctypes.c_uint32, [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_uint32]),
+    "chip8_set_halt_detection": (None, [ctypes.c_void_p, ctypes.c_bool]),
+    "chip8_ram": (ctypes.c_void_p, [ctypes.c_void_p]),
+    "chip8_framebuffer": (ctypes.c_void_p, [ctypes.c_void_p]),
+    "chip8_registers": (ctypes.c_void_p, [ctypes.c_void_p]),
+    "chip8_pc": (ctypes.c_uint16, [ctypes.c_void_p]),
+    "chip8_index": (ctypes.c_uint16, [ctypes.c_void_p]),
+    "chip8_delay_timer": (ctypes.c_uint8, [ctypes.c_void_p]),
+    "chip8_sound_timer": (ctypes.c_uint8, [ctypes.c_void_p]),
+    "chip8_cycle_count": (ctypes.c_uint64, [ctypes.c_void_p]),
+    "chip8_status": (ctypes.c_int, [ctypes.c_void_p]),
+    "chip8_fault": (ctypes.c_char_p, [ctypes.c_void_p]),
+    "chip8_halt_pc": (ctypes.c_uint16, [ctypes.c_void_p]),
+    "chip8_snapshot_save": (ctypes.c_void_p, [ctypes.c_void_p]),
+    "chip8_snapshot_restore": (None, [ctypes.c_void_p, ctypes.c_void_p]),
+    "chip8_snapshot_free": (None, [ctypes.c_void_p]),
+}
+
+for _name, (_restype, _argtypes) in _functions.items():
+    getattr(_lib, _name).restype = _restype
+    getattr(_lib, _name).argtypes = _argtypes
+
+
+def _view(address, shape):
+    """A writable view of the C memory at address, without copying it."""
+    size = 1
+    for length in shape:
+        size *= length
+
+    array = (ctypes.c_uint8 * size).from_address(address)
+    if numpy is not None:
+        return numpy.frombuffer(array, dtype=numpy.uint8).reshape(shape)
+    return memoryview(array).cast("B", shape)
+
+
+class Snapshot:
+    """A saved copy of the whole machine, see Machine.snapshot."""
+
+    def __init__(self, handle):
+        self._handle = handle
+
+    def __del__(self):
+        if self._handle:
+            _lib.chip8_snapshot_free(self._handle)
+            self._handle = None
+
+
+class Machine:
+    def __init__(self, rom=None):
+        self._handle = _lib.chip8_create()
+        if not self._handle:
+            raise RuntimeError("there is already a chip8.Machine in this process")
+
+        self.ram = _view(_lib.chip8_ram(self._handle), (RAM_SIZE,))
+        self.framebuffer = _view(_lib.chip8_framebuffer(self._handle), (SCREEN_HEIGHT, SCREEN_WIDTH))
+        self.registers = _view(_lib.chip8_registers(self._handle), (16,))
+
+        if rom is not None:
+            self.load_rom(rom)
+
+    def close(self):
+        if self._handle:
+            _lib.chip8_destroy(self._handle)
+            self._handle = None
+
+    def __del__(self):
+        self.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def reset(self):
+        _lib.chip8_reset(self._handle)
+
+    def load_rom(self, rom):
+        """Resets the machine and loads a ROM, from a path or from bytes."""
+        if isinstance(rom, (bytes, bytearray, memoryview)):
+            rom = bytes(rom)
+            failed = _lib.chip8_load_rom_bytes(self._handle, rom, len(rom))
+        else:
+            failed = _lib.chip8_load_rom(self._handle, os.fsencode(rom))
+
+        if failed:
+            raise ValueError("could not load the ROM")
+
+    def set_keys(self, keys):
+        """Holds the keys in the mask (bit n for key n) from now on."""
+        _lib.chip8_set_keys(self._handle, keys)
+
+    def step(self, cycles):
+        """Runs the given number of cycles. Returns how many ran."""
+        return _lib.chip8_step(self._handle, cycles)
+
+    def run_frames(self, keys):
+        """Runs one 60 Hz frame per entry of keys, holding that key mask
+        during it. Returns how many frames ran, fewer if the machine stopped.
+        """
+        if numpy is not None and isinstance(keys, numpy.ndarray):
+            keys = numpy.ascontiguousarray(keys, dtype=numpy.uint16)
+            return _lib.chip8_run_frames(self._handle, keys.ctypes.data, len(keys))
+
+        array = (ctypes.c_uint16 * len(keys))(*keys)
+        return _lib.chip8_run_frames(self._handle, array, len(keys))
+
+    def set_halt_detection(self, enabled):
+        """Stops the machine once the ROM can't do anything new, assuming the
+        keys stay the same from then on."""
+        _lib.chip8_set_halt_detection(self._handle, enabled)
+
+    def snapshot(self):
+        return Snapshot(_lib.chip8_snapshot_save(self._handle))
+
+    def restore(self, snapshot):
+        _lib.chip8_snapshot_restore(self._handle, snapshot._handle)
+
+    @property
+    def pc(self):
+        return _lib.chip8_pc(self._handle)
+
+    @property
+    def index(self):
+        return _lib.chip8_index(self._handle)
+
+    @property
+    def delay_timer(self):
+        return _lib.chip8_delay_timer(self._handle)
+
+    @property
+    def sound_timer(self):
+        return _lib.chip8_sound_timer(self._handle)
+
+    @property
+    def cycle_count(self):
+        return _lib.chip8_cycle_count(self._handle)
+
+    @property
+    def status(self):
+        """RUNNING, FAULTED or HALTED."""
+        return _lib.chip8_status(self._handle)
+
+    @property
+    def fault(self):
+        return _lib.chip8_fault(self._handle).decode()
+
+    @property
+    def halt_pc(self):
+        return _lib.chip8_halt_pc(self._handle)
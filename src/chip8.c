@@ -1,1079 +1,1352 @@
 #include "raylib.h"
+#include "chip8.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
 
-#define RAM_SIZE 4096
-#define STACK_DEPTH 16
-#define CPU_HZ 700
-
-#define FONT_SIZE 80
-#define SCREEN_WIDTH 64
-#define SCREEN_HEIGHT 32
 #define SCREEN_MULTIPLIER 10
 
-#define ROM_START_ADDRESS 0x200
-#define FONT_START_ADDRESS 0x050
-
-// Defining a byte as being 8 bit
-typedef uint8_t BYTE;
-typedef uint16_t ADDRESS;
-
-BYTE ram[RAM_SIZE];
-
-ADDRESS stack[STACK_DEPTH];
-// Stack pointer that points at the next free slot in the stack
-int8_t stack_pointer = 0;
+#define TURBO_KEY KEY_TAB
+#define SCREENSHOT_KEY KEY_F2
+#define RESET_KEY KEY_F8
+#define DEFAULT_KEYPAD_KEYS "0123456789ABCDEF"
+#define DEFAULT_ROM_DB_PATH "assets/romdb.txt"
+#define TURBO_DEFAULT_SPEED 8
+#define SPEED_SAMPLE_SECONDS 0.5
 
-BYTE delay_timer = 0;
-BYTE sound_timer = 0;
-
-ADDRESS pc = ROM_START_ADDRESS;
-ADDRESS I = 0;
-
-BYTE registers[16]; // 0-F
-
-bool pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
+/*
+If the emulation thread falls further behind the host clock than this (a
+hitch, or a host too slow for the speed asked), it drops the backlog instead
+of running it all in one long burst.
+*/
+#define EMULATION_MAX_LAG_SECONDS 0.1
+// How long the emulation thread naps between looks while the CPU is paused
+#define EMULATION_PAUSED_SLEEP_NS 2000000
+// With --frame-delay, leave at least a few ms of the 60 Hz frame for the work
+#define MAX_FRAME_DELAY_SECONDS 0.012
+// A key press that changed nothing on screen for this long isn't measured
+#define INPUT_LATENCY_TIMEOUT_SECONDS 0.5
+
+#define DEBUGGER_PAUSE_KEY KEY_F5
+#define DEBUGGER_OVERLAY_KEY KEY_F1
+#define DEBUGGER_BREAKPOINT_KEY KEY_F9
+#define DEBUGGER_STEP_OVER_KEY KEY_F10
+#define DEBUGGER_STEP_KEY KEY_F11
+// How many instructions the disassembly view shows before and after the PC
+#define DISASSEMBLY_CONTEXT 6
+
+// Emulated clock speed as measured against the host clock
+double measured_hz = 0;
+double speed_sample_start_time = 0;
+uint64_t speed_sample_start_cycle = 0;
+
+bool debugger_overlay_visible = false;
 
 /*
-  The index of this array will point to the physical scancode.
-  For example, indexing int_to_ascii[0xF] will point to the scancode for V
+Plays the given tone, unless the tone is already playing.
 */
-// int int_to_ascii[16] = {
-//     88,         // 0
-//     49, 50, 51, // 1 2 3
-//     81, 87, 69, // 4 5 6
-//     65, 83, 68, // 7 8 9
-//     90, 67, 52, // A B C
-//     82, 70, 86  // D E F
-// };
-
-int push_to_stack(ADDRESS address)
+void play_tone_if_not_already_playing(Sound tone)
 {
-  if (stack_pointer >= STACK_DEPTH)
+  if (!IsSoundPlaying(tone))
   {
-    perror("Stack overflow.");
-    return 1;
+    PlaySound(tone);
   }
-
-  stack[stack_pointer] = address;
-  stack_pointer += 1;
-
-  return 0;
 }
 
-ADDRESS pop_from_stack()
-{
-  if (stack_pointer == 0)
-  {
-    perror("Stack underflow.");
-    exit(EXIT_FAILURE);
-  }
-
-  stack_pointer -= 1;
-  ADDRESS address = stack[stack_pointer];
-
-  return address;
-}
+// The window's picture of the screen, expanded by the same kernel as the
+// exports and uploaded to window_texture every frame
+uint32_t window_pixels[SCREEN_HEIGHT * SCREEN_MULTIPLIER][SCREEN_WIDTH * SCREEN_MULTIPLIER];
+Texture2D window_texture;
+bool window_texture_loaded = false;
+int screenshot_count = 0;
 
 /*
-Takes the file provided as argument and loads it into ram starting at
-ROM_START_ADDRESS.
+Returns window_pixels as a raylib image. The image doesn't own the pixels.
 */
-int load_rom_to_ram(char *filename)
+Image window_image(void)
 {
-  FILE *rom = fopen(filename, "rb");
-
-  if (!rom)
-  {
-    perror("ROM not found.");
-    return 1;
-  }
-
-  int file_byte;
-  int i = 0;
-  // Reading the file one byte at a time into byte
-  while ((file_byte = fgetc(rom)) != EOF)
-  {
-    // TODO: Unsafe. If the ROM is too large, you'll go oob. do ram size - rom
-    // start addr to check
-    ram[pc + i] = file_byte;
-    i++;
-  }
+  Image image = {
+      .data = window_pixels,
+      .width = SCREEN_WIDTH * SCREEN_MULTIPLIER,
+      .height = SCREEN_HEIGHT * SCREEN_MULTIPLIER,
+      .mipmaps = 1,
+      .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+  };
 
-  fclose(rom);
-  return 0;
+  return image;
 }
 
 /*
-Dumps the contents of the Chip-8 RAM to a file in the root folder.
-
-IMPROVEMENT: Make the filename an argument.
+Draws a frame packed by pack_screen in the window, in screen_style.
 */
-int dump_ram(void)
+void draw_screen(const uint64_t rows[SCREEN_HEIGHT])
 {
-  FILE *ram_dump = fopen("ram_dump.bin", "w");
-  if (!ram_dump)
-  {
-    perror("Failed creating the file ram_dump.bin");
-    return 1;
-  }
+  expand_screen_rgba(rows, SCREEN_MULTIPLIER, &screen_style, &window_pixels[0][0]);
 
-  size_t num_bytes_dumped = fwrite(ram, sizeof ram[0], RAM_SIZE, ram_dump);
-  printf("Dumped %zu bytes out of %d requested.\n", num_bytes_dumped, RAM_SIZE);
-  fclose(ram_dump);
-
-  if (num_bytes_dumped == RAM_SIZE)
+  if (!window_texture_loaded)
   {
-    return 0;
+    window_texture = LoadTextureFromImage(window_image());
+    window_texture_loaded = true;
   }
   else
   {
-    return 1;
+    UpdateTexture(window_texture, window_pixels);
   }
+
+  DrawTexture(window_texture, 0, 0, WHITE);
 }
 
 /*
-Zeroes out the Chip-8's RAM.
-
-IMPROVEMENT: Make the ram array an argument. But remember how variables work in C, and how functions only alter a local version of what you pass in. So you may need some pointer stuff.
-
-IMPROVEMENT: Don't rely on the global RAM_SIZE define, measure instead the size of the RAM from within the function.
+Frees the window's texture. Call before closing the window.
 */
-int reset_ram(void)
+void unload_screen_texture(void)
 {
-  // Blank out memory
-  for (int i = 0; i < RAM_SIZE; i++)
+  if (window_texture_loaded)
   {
-    ram[i] = 0;
+    UnloadTexture(window_texture);
+    window_texture_loaded = false;
   }
-
-  return 0;
 }
 
 /*
-Places font information in RAM, starting at address 0x050.
-
-IMPROVEMENT: Pass the RAM in as argument. Again remember how C passes values.
-
-IMPROVEMENT: Pass the start address in as argument.
+Saves the last frame drawn by draw_screen to the first free
+screenshot_NNN.png in the working directory.
 */
-void burn_font_to_ram(void)
+void save_screenshot(void)
 {
-  int font[FONT_SIZE] = {
-      0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-      0x20, 0x60, 0x20, 0x20, 0x70, // 1
-      0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-      0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-      0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-      0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-      0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-      0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-      0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-      0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-      0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-      0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-      0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-      0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-      0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-      0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-  };
+  char filename[32];
+
+  do
+  {
+    snprintf(filename, sizeof filename, "screenshot_%03d.png", screenshot_count++);
+  } while (access(filename, F_OK) == 0);
 
-  for (int i = 0; i < FONT_SIZE; i++)
+  if (ExportImage(window_image(), filename))
   {
-    ram[FONT_START_ADDRESS + i] = font[i];
+    printf("Saved %s\n", filename);
   }
 }
 
 /*
-Initializes the Chip-8 RAM, making it ready for execution.
-
-TODO: Many things to do here to init. Zero the timers, reset PC and I, registers, stack_pointer, pixels. basically make it so that you can reset it while the emu is running.
+Parses "RRGGBB,RRGGBB", the on and off colors in hex, into screen_style.
+Returns 0 on success.
 */
-void init_ram(void)
+int parse_screen_colors(const char *text)
 {
-  // 0x000 - 0x1FF are reserved by the interpreter. 0x200+ are for the ROM.
-  reset_ram();
-  burn_font_to_ram();
-}
+  unsigned int on;
+  unsigned int off;
 
-/*
-Plays the given tone, unless the tone is already playing.
-*/
-void play_tone_if_not_already_playing(Sound tone)
-{
-  if (!IsSoundPlaying(tone))
+  if (sscanf(text, "%6x,%6x", &on, &off) != 2)
   {
-    PlaySound(tone);
+    return 1;
   }
+
+  screen_style.on_color = RGBA_COLOR(on >> 16, (on >> 8) & 0xFF, on & 0xFF, 255);
+  screen_style.off_color = RGBA_COLOR(off >> 16, (off >> 8) & 0xFF, off & 0xFF, 255);
+  return 0;
 }
 
 /*
-Decreases by 1 the sound and delay timers.
+Updates measured_hz once every SPEED_SAMPLE_SECONDS of host time, given the
+cycle count of the frame being shown.
 */
-void decrease_timers(void)
+void sample_emulation_speed(double now, uint64_t cycles)
 {
-  if (sound_timer > 0)
+  double elapsed = now - speed_sample_start_time;
+
+  // The machine was reset under the sample
+  if (cycles < speed_sample_start_cycle)
   {
-    sound_timer--;
+    speed_sample_start_time = now;
+    speed_sample_start_cycle = cycles;
+    return;
   }
 
-  if (delay_timer > 0)
+  if (elapsed >= SPEED_SAMPLE_SECONDS)
   {
-    delay_timer--;
+    measured_hz = (cycles - speed_sample_start_cycle) / elapsed;
+    speed_sample_start_time = now;
+    speed_sample_start_cycle = cycles;
   }
 }
 
 /*
-Draws a Raylib rectangle of size (SCREEN_MULTIPLIER - 1) * (SCREEN_MULTIPLIER - 1) at the given x, y location of the Chip-8's display. x, y must be within the bounds of the Chip-8 display size.
-
-IMPROVEMENT: Return an error upon receiving a non-valid x or y value.
-
-IMPROVEMENT: Make the "black" line around the rectangles configurable as argument.
-*/
-void paint_pixel_at_virtual_location(int x, int y, Color color, int border_width)
-{
-  DrawRectangle(x * SCREEN_MULTIPLIER, y * SCREEN_MULTIPLIER,
-                SCREEN_MULTIPLIER - border_width, // -1 to get a "grid"
-                SCREEN_MULTIPLIER - border_width, color);
-}
-
-/*
-Returns the instruction in RAM at the current PC. Then increases the PC by 2, so that it points to the next instruction.
+Draws the fast-forward overlay in the top left corner: the speed multiplier
+(or "max" when unthrottled) and the measured emulated clock speed.
 */
-uint16_t fetch_instruction_and_increment_pc(void)
+void draw_speed_overlay(int speed, bool unthrottled)
 {
-  // Instructions are 16 bit
-  uint16_t instruction_high = ram[pc];
-  uint8_t instruction_low = ram[pc + 1];
-
-  uint16_t instruction = (instruction_high << 8) | instruction_low;
-
-  pc += 0x002;
-  return instruction;
-}
+  char text[48];
 
-/*
-Sets all virtual pixels to 0.
-*/
-void clear_background(void)
-{
-  for (int i = 0; i < SCREEN_HEIGHT; i++)
+  if (unthrottled)
   {
-    for (int n = 0; n < SCREEN_WIDTH; n++)
-    {
-      pixels[i][n] = false;
-    }
+    snprintf(text, sizeof text, ">> max  %.0f Hz", measured_hz);
   }
-}
-
-/*
-Draws Raylib rectangles on screen based on the values of the virtual pixels.
-
-Draws white rectangles if true, black if false.
-
-IMPROVEMENT: Draw nothing if false.
-*/
-void draw_screen(void)
-{
-  // Draws rectangles on screen based on the "pixels" matrix
-  for (int i = 0; i < SCREEN_HEIGHT; i++)
+  else
   {
-    for (int n = 0; n < SCREEN_WIDTH; n++)
-    {
-      if (pixels[i][n])
-      {
-        paint_pixel_at_virtual_location(n, i, RAYWHITE, 0);
-      }
-      else
-      {
-        paint_pixel_at_virtual_location(n, i, BLACK, 0);
-      }
-    }
+    snprintf(text, sizeof text, ">> x%d  %.0f Hz", speed, measured_hz);
   }
+
+  DrawText(text, 4, 4, 20, GREEN);
 }
 
 /*
-Executes the given instruction.
+Writes the mnemonic for the given instruction into out, in the same notation
+as the comments in execute_instruction.
 */
-void execute_instruction(uint16_t instruction, int key_pressed)
+void disassemble(uint16_t instruction, char *out, size_t size)
 {
-
-  if (key_pressed != 0)
-  {
-    printf("Key pressed: %d\n", key_pressed);
-  }
+  int x = (instruction & 0x0F00) >> 8;
+  int y = (instruction & 0x00F0) >> 4;
+  int n = instruction & 0x000F;
+  int kk = instruction & 0x00FF;
+  int nnn = instruction & 0x0FFF;
 
   switch (instruction & 0xF000)
   {
   case 0x0000:
-  {
-    /*
-    00E0 - CLS
-    Clear the display.
-    */
     if (instruction == 0x00E0)
     {
-      clear_background();
-      break;
+      snprintf(out, size, "CLS");
     }
-    /*
-    00EE - RET
-    Return from a subroutine.
-    */
     else if (instruction == 0x00EE)
     {
-      /*
-      Pop the address from the stack and set the PC to it, so we can
-      resume execution.
-      */
-      pc = pop_from_stack();
-      break;
+      snprintf(out, size, "RET");
+    }
+    else
+    {
+      snprintf(out, size, "SYS 0x%03X", nnn);
     }
-
     break;
-  }
-
   case 0x1000:
-  {
-    /*
-    nnn - JP addr
-    Jump to location nnn.
-    */
-    pc = (instruction & 0x0FFF);
+    snprintf(out, size, "JP 0x%03X", nnn);
     break;
-  }
-
   case 0x2000:
-  {
-    /*
-    2nnn - CALL addr
-    Call subroutine at nnn.
-    */
-
-    /*
-    In a normal jump, we move the PC to the new instruction, and that's it.
-
-    As this is a jump to subroutine though, this means that at some point we
-    will exit it and resume execution.
-
-    This is where the stack comes into play.
-
-    Before moving the PC to the new location, we push the current location of
-    the PC to the stack. Then, when we return from the subroutine (another
-    opcode), we resume execution as normal.
-
-    So here, just push the current PC to the stack and then jump to the
-    subroutine's address.
-    */
-    push_to_stack(pc);
-    pc = (instruction & 0x0FFF);
-
+    snprintf(out, size, "CALL 0x%03X", nnn);
     break;
-  }
-
   case 0x3000:
-  {
-    /*
-    3xkk - SE Vx, byte
-    Skip next instruction if Vx = kk
-    */
-    int vx_value = registers[(instruction & 0x0F00) >> 8];
-    int nn = (instruction & 0x00FF);
-
-    if (vx_value == nn)
-    {
-      pc += 2;
-    }
-
+    snprintf(out, size, "SE V%X, 0x%02X", x, kk);
     break;
-  }
-
   case 0x4000:
-  {
-    /*
-    4xkk - SNE Vx, byte
-    Skip next instruction if Vx != kk
-    */
-    int vx_value = registers[(instruction & 0x0F00) >> 8];
-    int nn = (instruction & 0x00FF);
-
-    if (vx_value != nn)
-    {
-      pc += 2;
-    }
-
+    snprintf(out, size, "SNE V%X, 0x%02X", x, kk);
     break;
-  }
-
   case 0x5000:
-  {
-    /*
-    5xy0 - SE Vx, Vy
-    Skip next instruction if Vx = Vy
-    */
-    int vx_value = registers[(instruction & 0x0F00) >> 8];
-    int vy_value = registers[(instruction & 0x00F0) >> 4];
-
-    if (vx_value == vy_value)
-    {
-      pc += 2;
-    }
-
+    snprintf(out, size, "SE V%X, V%X", x, y);
     break;
-  }
-
   case 0x6000:
-  {
-    /*
-    6xkk - LD Vx, byte
-    Set Vx = kk
-    */
-    registers[(instruction & 0x0F00) >> 8] = instruction & 0x00FF;
+    snprintf(out, size, "LD V%X, 0x%02X", x, kk);
     break;
-  }
-
   case 0x7000:
-  {
-    /*
-    7xkk - ADD Vx, byte
-    Adds the value kk to the value of the register Vx, then stores the result in
-    Vx.
-    */
-    registers[(instruction & 0x0F00) >> 8] += instruction & 0x00FF;
+    snprintf(out, size, "ADD V%X, 0x%02X", x, kk);
     break;
-  }
-
   case 0x8000:
   {
-    int opflag = (instruction & 0x000F);
-    int x = (instruction & 0x0F00) >> 8;
-    int y = (instruction & 0x00F0) >> 4;
-
-    switch (opflag)
+    const char *names[16] = {"LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN",
+                             NULL, NULL, NULL, NULL, NULL, NULL, "SHL", NULL};
+    if (names[n] != NULL)
     {
-    case 0x0000:
-    {
-      /*
-      8XY0 - LD Vx, Vy
-      Set Vx = Vy
-      */
-      registers[x] = registers[y];
-      break;
+      snprintf(out, size, "%s V%X, V%X", names[n], x, y);
     }
-
-    case 0x0001:
+    else
     {
-      /*
-      8xy1 - OR Vx, Vy
-      Set Vx = Vx OR Vy
-      */
-      registers[x] = (registers[x] | registers[y]);
-      break;
+      snprintf(out, size, "DW 0x%04X", instruction);
     }
-
-    case 0x0002:
+    break;
+  }
+  case 0x9000:
+    snprintf(out, size, "SNE V%X, V%X", x, y);
+    break;
+  case 0xA000:
+    snprintf(out, size, "LD I, 0x%03X", nnn);
+    break;
+  case 0xB000:
+    snprintf(out, size, "JP V0, 0x%03X", nnn);
+    break;
+  case 0xC000:
+    snprintf(out, size, "RND V%X, 0x%02X", x, kk);
+    break;
+  case 0xD000:
+    snprintf(out, size, "DRW V%X, V%X, %d", x, y, n);
+    break;
+  case 0xE000:
+    if (kk == 0x9E)
     {
-      /*
-      8xy2 - AND Vx, Vy
-      Set Vx = Vx AND Vy
-      */
-      registers[x] = (registers[x] & registers[y]);
-      break;
+      snprintf(out, size, "SKP V%X", x);
     }
-
-    case 0x0003:
+    else if (kk == 0xA1)
     {
-      /*
-      8xy3 - XOR Vx, Vy
-      Set Vx = Vx XOR Vy
-      */
-      registers[x] = (registers[x] ^ registers[y]);
-      break;
+      snprintf(out, size, "SKNP V%X", x);
     }
-
-    case 0x0004:
+    else
     {
-      /*
-      8xy4 - ADD Vx, Vy
-      Set Vx = Vx + Vy, set VF = carry.
-      */
-
-      /*
-      The value of VX is set to the value of VX + value of XY
-      If the result is larger than 255 (8 bits), only the lowest 8 bits are
-      stored and VF is set to 1. Otherwise, VF is set to 0.
-      */
-      if (registers[x] + registers[y] > 0b11111111)
-      {
-        // Result overflows. Only store lowest 8 bits
-        registers[x] = (registers[x] + registers[y]) & 0b11111111; // I hope this is right
-        registers[0xF] = 1;
-        break;
-      }
-      else
-      { // Result does not overflow
-        registers[x] = registers[x] + registers[y];
-        registers[0xF] = 0;
-        break;
-      }
+      snprintf(out, size, "DW 0x%04X", instruction);
     }
-
-    case 0x0005:
+    break;
+  default:
+    switch (kk)
     {
-      /*
-      8xy5 - SUB Vx, Vy
-      Set Vx = Vx - Vy, set VF = NOT borrow.
-      */
-
-      // If Vx > Vy -> VF = 1, otherwise VF = 0
-      if (registers[x] > registers[y])
-      {
-        registers[0xF] = 1;
-      }
-      else
-      {
-        registers[0xF] = 0;
-      }
-
-      registers[x] = registers[x] - registers[y];
+    case 0x07:
+      snprintf(out, size, "LD V%X, DT", x);
       break;
-    }
-
-    case 0x0006:
-    {
-      /*
-      8xy6 - SHR Vx {, Vy}
-      Set Vx = Vx SHR 1.
-      */
-
-      /*
-      Shift right. In case of odd numbers (last bit = 1), we set VF = 1
-
-      Practically:
-      If least-significant bit of Vx is 1, VF = 1. Otherwise, VF = 0.
-      Then, shift Vx 1 to the right (floor divide by 2)
-      */
-      // WARNING: Different interpreters do this differently. Check docs.
-      if ((registers[x] & 0b00000001) == 0b000000001)
-      {
-        registers[0xF] = 1;
-      }
-      else
-      {
-        registers[0xF] = 0;
-      }
-      registers[x] = (registers[x] >> 1);
+    case 0x0A:
+      snprintf(out, size, "LD V%X, K", x);
       break;
-    }
-
-    case 0x0007:
-    {
-      /*
-      8xy7 - SUBN Vx, Vy
-      Set Vx = Vy - Vx, set VF = NOT borrow.
-      */
-
-      if (registers[y] > registers[x])
-      {
-        registers[0xF] = 1;
-      }
-      else
-      {
-        registers[0xF] = 0;
-      }
-
-      registers[x] = registers[y] - registers[x];
+    case 0x15:
+      snprintf(out, size, "LD DT, V%X", x);
       break;
-    }
-
-    case 0x000E:
-    {
-      /*
-      8xyE - SHL Vx {, Vy}
-      Set Vx = Vx SHL 1.
-      */
-
-      /*
-      Shift left. If left-most bit is 1, set VF = 1, otherwise VF = 0.
-      */
-      // WARNING: Different interpreters do this differently. Check docs.
-      if ((registers[x] & 0b10000000) == 0b10000000)
-      {
-        registers[0xF] = 1;
-      }
-      else
-      {
-        registers[0xF] = 0;
-      }
-      registers[x] = (registers[x] << 1);
+    case 0x18:
+      snprintf(out, size, "LD ST, V%X", x);
+      break;
+    case 0x1E:
+      snprintf(out, size, "ADD I, V%X", x);
+      break;
+    case 0x29:
+      snprintf(out, size, "LD F, V%X", x);
+      break;
+    case 0x33:
+      snprintf(out, size, "LD B, V%X", x);
+      break;
+    case 0x55:
+      snprintf(out, size, "LD [I], V%X", x);
+      break;
+    case 0x65:
+      snprintf(out, size, "LD V%X, [I]", x);
+      break;
+    default:
+      snprintf(out, size, "DW 0x%04X", instruction);
       break;
-    }
     }
     break;
   }
+}
 
-  case 0x9000:
+/*
+Handles the debugger hotkeys: pause/continue, toggle a breakpoint at the PC,
+step, step over, and show/hide the overlay.
+
+Runs on the window thread, so it takes machine_lock for anything touching the
+machine.
+*/
+void handle_debugger_keys(void)
+{
+  if (IsKeyPressed(DEBUGGER_OVERLAY_KEY))
   {
-    /*
-    9xy0 - SNE Vx, Vy
-    Skip next instruction if Vx != Vy.
-    */
-    int vx_value = registers[(instruction & 0x0F00) >> 8];
-    int vy_value = registers[(instruction & 0x00F0) >> 4];
+    debugger_overlay_visible = !debugger_overlay_visible;
+  }
+
+  if (!IsKeyPressed(DEBUGGER_PAUSE_KEY) && !IsKeyPressed(DEBUGGER_BREAKPOINT_KEY) &&
+      !IsKeyPressed(DEBUGGER_STEP_KEY) && !IsKeyPressed(DEBUGGER_STEP_OVER_KEY))
+  {
+    return;
+  }
 
-    if (vx_value != vy_value)
+  pthread_mutex_lock(&machine_lock);
+
+  if (IsKeyPressed(DEBUGGER_PAUSE_KEY))
+  {
+    if (debugger_paused)
     {
-      pc += 2;
+      debugger_resume();
+    }
+    else
+    {
+      debugger_paused = true;
+      snprintf(debugger_message, sizeof debugger_message, "Paused at 0x%03X", pc);
     }
-
-    break;
   }
 
-  case 0xA000:
+  if (IsKeyPressed(DEBUGGER_BREAKPOINT_KEY))
   {
-    /*
-    Annn - LD I, addr
-    Set I = nnn.
-    */
-    I = instruction & 0x0FFF;
-    break;
+    toggle_breakpoint(pc);
   }
 
-  case 0xB000:
+  if (debugger_paused && IsKeyPressed(DEBUGGER_STEP_KEY))
+  {
+    debugger_step();
+  }
+  else if (debugger_paused && IsKeyPressed(DEBUGGER_STEP_OVER_KEY))
   {
-    /*
-    Bnnn - JP V0, addr
-    Jump to location nnn + V0.
-    */
+    debugger_step_over();
+  }
 
-    // WARNING: Implementations vary. Check documentation.
-    pc = (instruction & 0x0FFF) + registers[0];
-    break;
+  pthread_mutex_unlock(&machine_lock);
+}
+
+/*
+Draws the debugger panel on the right side of the window: status, registers,
+stack and a disassembly of the instructions around the PC. Lines marked with
+'*' have a breakpoint, '>' is the PC.
+*/
+void draw_debugger_overlay(void)
+{
+  const int font_size = 10;
+  const int line_height = 12;
+  const int panel_width = 240;
+  int panel_x = SCREEN_WIDTH * SCREEN_MULTIPLIER - panel_width;
+  int text_x = panel_x + 6;
+  int line_y = 4;
+  char line[96];
+
+  DrawRectangle(panel_x, 0, panel_width, SCREEN_HEIGHT * SCREEN_MULTIPLIER,
+                (Color){0, 0, 0, 210});
+
+  snprintf(line, sizeof line, "%s  %s", debugger_paused ? "PAUSED" : "RUNNING", debugger_message);
+  DrawText(line, text_x, line_y, font_size, debugger_paused ? YELLOW : GREEN);
+  line_y += line_height + 4;
+
+  for (int row = 0; row < 4; row++)
+  {
+    snprintf(line, sizeof line, "V%X=%02X  V%X=%02X  V%X=%02X  V%X=%02X",
+             row * 4, registers[row * 4], row * 4 + 1, registers[row * 4 + 1],
+             row * 4 + 2, registers[row * 4 + 2], row * 4 + 3, registers[row * 4 + 3]);
+    DrawText(line, text_x, line_y, font_size, RAYWHITE);
+    line_y += line_height;
   }
 
-  case 0xC000:
+  snprintf(line, sizeof line, "PC=%03X  I=%03X  DT=%02X  ST=%02X", pc, I, delay_timer, sound_timer);
+  DrawText(line, text_x, line_y, font_size, RAYWHITE);
+  line_y += line_height + 4;
+
+  // The stack, most recent call first, up to 8 entries per line
+  snprintf(line, sizeof line, "Stack (%d):", stack_pointer);
+  for (int i = stack_pointer - 1; i >= 0; i--)
   {
-    /*
-    Cxkk - RND Vx, byte
-    Set Vx = random byte AND kk.
-    */
-    int random_byte = 256;
+    size_t used = strlen(line);
+    snprintf(line + used, sizeof line - used, " %03X", stack[i]);
 
-    // I got this from cppreference. It's probably flawed in some way.
-    while (random_byte > 255)
+    if (i % 8 == 0 || i == 0)
     {
-      random_byte = 1 + rand() / ((RAND_MAX + 1u) / 255);
+      DrawText(line, text_x, line_y, font_size, SKYBLUE);
+      line_y += line_height;
+      line[0] = '\0';
     }
-
-    registers[(instruction & 0x0F00) >> 8] = random_byte & (instruction & 0x00FF);
-    break;
   }
+  if (stack_pointer == 0)
+  {
+    DrawText(line, text_x, line_y, font_size, SKYBLUE);
+    line_y += line_height;
+  }
+  line_y += 4;
 
-  case 0xD000:
+  for (int i = -DISASSEMBLY_CONTEXT; i <= DISASSEMBLY_CONTEXT; i++)
   {
-    /*
-    Dxyn - DRW Vx, Vy, nibble
-    Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
-    */
+    ADDRESS address = (pc + 2 * i) % RAM_SIZE;
+    char mnemonic[24];
+
+    disassemble(peek_instruction(address), mnemonic, sizeof mnemonic);
+    snprintf(line, sizeof line, "%c%c %03X  %04X  %s",
+             has_breakpoint(address) ? '*' : ' ', i == 0 ? '>' : ' ',
+             address, peek_instruction(address), mnemonic);
+    DrawText(line, text_x, line_y, font_size, i == 0 ? YELLOW : GRAY);
+    line_y += line_height;
+  }
 
-    // Draw sprite of N height from memory location at address I at X, Y
+  DrawText("F5 run/pause  F9 break  F10 over  F11 step", text_x,
+           SCREEN_HEIGHT * SCREEN_MULTIPLIER - line_height - 2, font_size, DARKGRAY);
+}
 
-    // Get X and Y coords (if they overflow, they should wrap)
-    int x = registers[(instruction & 0x0F00) >> 8] % SCREEN_WIDTH;
-    int y = registers[(instruction & 0x00F0) >> 4] % SCREEN_HEIGHT;
+/*
+Plays back a .c8r recording in the window, at the speed it was recorded.
+When the recording ends the last frame stays up until the window is closed.
+*/
+int play_recording(char *filename)
+{
+  if (recording_open(filename) != 0)
+  {
+    return 1;
+  }
 
-    int sprite_height = (instruction & 0x000F);
+  InitWindow(SCREEN_WIDTH * SCREEN_MULTIPLIER,
+             SCREEN_HEIGHT * SCREEN_MULTIPLIER, "CHIP-8 player");
+  SetTargetFPS(60);
 
-    // Reset collision flag
-    registers[0xF] = 0;
+  uint64_t rows[SCREEN_HEIGHT];
+  uint64_t shown_rows[SCREEN_HEIGHT] = {0};
+  uint64_t next_frame = 0;
+  uint64_t frame_number = 0;
+  bool have_next = recording_next_frame(rows, &next_frame);
 
-    // For each sprite row
-    for (int n = 0; n < sprite_height; n++)
+  while (!WindowShouldClose())
+  {
+    // Show every recorded frame that's due by now
+    while (have_next && next_frame <= frame_number)
     {
-      uint8_t sprite_row = ram[I + n];
-      // That's something like 11110000
-      registers[0xF] = 0;
-
-      for (int p = 0; p < 8; p++)
-      {
-        // For each bit in the row, we get a single "pixel" (l to r)
-
-        // Sliding mask to get one bit ("pixel") at a time
-        uint8_t mask = 0b10000000 >> p;
-        /*
-        p: 0
-        spriteRow: 11110000
-        mask:      10000000
-
-        pixelToDraw: 10000000 >> (7-p) --> 00000001
-        */
-        bool pixel_to_draw = (sprite_row & mask) >> (7 - p);
-        if (pixel_to_draw)
-        {
-          bool pixel_on_screen = pixels[(y + n) % SCREEN_HEIGHT][(x + p) % SCREEN_WIDTH];
-
-          /*
-          If pixel on screen is 1, and we flip it to 0, set VF to 1.
-          Otherwise, set it to 0.
-          */
-          if (pixel_to_draw && pixel_on_screen)
-          {
-            registers[0xF] = 1;
-          }
-
-          /*
-          This pixel needs to be drawn on screen.
-          We flip the pixel on screen.
-          */
-          pixels[(y + n) % SCREEN_HEIGHT][(x + p) % SCREEN_WIDTH] = !pixel_on_screen;
-        }
-      }
+      memcpy(shown_rows, rows, sizeof rows);
+      have_next = recording_next_frame(rows, &next_frame);
     }
 
-    break;
+    BeginDrawing();
+    ClearBackground(BLACK);
+    draw_screen(shown_rows);
+    EndDrawing();
+
+    frame_number++;
   }
 
-  case 0xE000:
+  recording_close();
+  unload_screen_texture();
+  CloseWindow();
+  return 0;
+}
+
+/*
+A finished frame, as handed from the emulation thread to the window.
+*/
+typedef struct
+{
+  uint64_t rows[SCREEN_HEIGHT];
+  uint64_t cycle_count;
+  bool sound_on;
+  // The latest window_input_serial the frame ran with
+  unsigned input_serial;
+} PresentedFrame;
+
+/*
+Lock-free triple buffer between the emulation thread, which writes frames,
+and the window, which presents them.
+
+Each side owns one slot and the third sits in the middle. The writer fills its
+slot, then swaps it with the middle one and flags it as fresh. The reader
+swaps its slot with the middle one only when there's a fresh frame there.
+Neither side ever waits for the other, and the window always gets the latest
+finished frame.
+*/
+#define TRIPLE_BUFFER_FRESH 4
+
+PresentedFrame frame_slots[3];
+atomic_int middle_slot = 1;
+int back_slot = 0;  // Emulation thread only
+int front_slot = 2; // Window only
+
+/*
+Settings shared with the emulation thread. The window writes these, the
+emulation thread reads them once per frame.
+*/
+atomic_bool emulation_running = true;
+atomic_bool turbo_enabled = false;
+atomic_uint window_keypad = 0;
+// Bumped by the window on every key press, see note_key_press
+atomic_uint window_input_serial = 0;
+// Fixed before the emulation thread starts
+int turbo_speed = TURBO_DEFAULT_SPEED;
+bool turbo_unthrottled = false;
+
+/*
+Called with machine_lock held after each frame, by whichever thread runs the
+emulation.
+*/
+void publish_frame(unsigned input_serial)
+{
+  PresentedFrame *frame = &frame_slots[back_slot];
+
+  pack_screen(frame->rows);
+  frame->cycle_count = cycle_count;
+  frame->sound_on = sound_timer > 0;
+  frame->input_serial = input_serial;
+
+  back_slot = atomic_exchange_explicit(&middle_slot, back_slot | TRIPLE_BUFFER_FRESH,
+                                       memory_order_acq_rel) &
+              3;
+}
+
+/*
+Returns the most recent frame published by the emulation thread.
+*/
+const PresentedFrame *latest_frame(void)
+{
+  if (atomic_load_explicit(&middle_slot, memory_order_relaxed) & TRIPLE_BUFFER_FRESH)
   {
-    int key_pressed_in_hex = -1;
+    front_slot = atomic_exchange_explicit(&middle_slot, front_slot, memory_order_acq_rel) & 3;
+  }
 
-    if (key_pressed != 0)
-    {
-      if (key_pressed >= 48 && key_pressed <= 57)
-      {
-        key_pressed_in_hex = key_pressed - 48;
-      }
+  return &frame_slots[front_slot];
+}
 
-      // If key pressed is a letter
-      if (key_pressed >= 65 && key_pressed <= 70)
-      {
-        key_pressed_in_hex = key_pressed - 55;
-      }
+/*
+Monotonic host time in seconds. Unlike raylib's GetTime, safe to call from
+any thread.
+*/
+double host_seconds(void)
+{
+  struct timespec now;
 
-      printf("Key pressed in dec: %d\n", key_pressed_in_hex);
-    }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-    switch (instruction & 0x00FF)
-    {
-    case 0x009E:
-    {
-      /*
-      Ex9E - SKP Vx
-      Skip next instruction if key with the value of Vx is pressed.
-      */
+void sleep_seconds(double seconds)
+{
+  if (seconds <= 0)
+  {
+    return;
+  }
 
-      /*
-      Checks the keyboard, and if the key corresponding to the value of Vx is currently in the down position, PC is increased by 2.
-      */
+  struct timespec duration = {
+      .tv_sec = (time_t)seconds,
+      .tv_nsec = (long)((seconds - (time_t)seconds) * 1e9),
+  };
 
-      if (key_pressed_in_hex != -1)
-      {
-        if (key_pressed_in_hex == registers[((instruction & 0x0F00) >> 8)])
-        {
-          pc += 2;
-        }
-      }
+  nanosleep(&duration, NULL);
+}
 
-      break;
-    }
+// The keyboard key for each Chip-8 key. raylib's codes for letters and digits
+// are their upper case ASCII
+char keypad_keys[16] = DEFAULT_KEYPAD_KEYS;
+
+/*
+Reads which Chip-8 keys are held on the keyboard. By default the keys 0-9 and
+A-F map to the Chip-8 key with the same label, the ROM database can change
+that.
+*/
+uint16_t read_keyboard_keypad(void)
+{
+  uint16_t mask = 0;
 
-    case 0x00A1:
+  for (int key = 0; key < 16; key++)
+  {
+    if (IsKeyDown(keypad_keys[key]))
     {
-      /*
-      ExA1 - SKNP Vx
-      Skip next instruction if key with the value of Vx is not pressed.
-      */
+      mask |= 1 << key;
+    }
+  }
 
-      /*
-      Checks the keyboard, and if the key corresponding to the value of Vx is currently in the up position, PC is increased by 2.
-      */
+  return mask;
+}
 
-      if (key_pressed_in_hex != -1)
-      {
-        if (key_pressed_in_hex != registers[((instruction & 0x0F00) >> 8)])
-        {
-          pc += 2;
-        }
-      }
+/*
+The ROM as last read from disk, so it can be restarted without reading the
+file again, which may be half written by then.
+*/
+BYTE rom_image[RAM_SIZE - ROM_START_ADDRESS];
+size_t rom_image_size = 0;
 
-      break;
-    }
+/*
+Reads the ROM file into rom_image. Leaves rom_image as it was if the file
+can't be read or doesn't fit. Returns 0 on success.
+*/
+int read_rom_image(const char *path)
+{
+  BYTE image[sizeof rom_image + 1];
+  FILE *rom = fopen(path, "rb");
 
-    default:
-      break;
-    }
+  if (!rom)
+  {
+    perror("ROM not found.");
+    return 1;
+  }
 
-    break;
+  size_t size = fread(image, 1, sizeof image, rom);
+  bool failed = ferror(rom);
+  fclose(rom);
+
+  if (failed)
+  {
+    perror("Failed reading the ROM");
+    return 1;
+  }
+  if (size > sizeof rom_image)
+  {
+    fprintf(stderr, "ROM too large, it must fit in %zu bytes.\n", sizeof rom_image);
+    return 1;
   }
 
-  case 0xF000:
+  memcpy(rom_image, image, size);
+  rom_image_size = size;
+  return 0;
+}
+
+/*
+What the command line asked for, which the ROM database doesn't override.
+Fixed once the arguments are read.
+*/
+bool use_rom_db = true;
+bool vip_requested = false;
+bool colors_requested = false;
+ScreenStyle requested_style;
+
+/*
+Sets the platform, quirks, clock, keys and colors for rom_image: the
+defaults and the command line, with the ROM's database entry on top if it
+has one. --vip and --colors win over the entry, but an entry's quirks= still
+applies with --vip, since it's about that ROM in particular. Only call it
+right after reset_machine, since it sets cpu_hz.
+*/
+void apply_rom_settings(void)
+{
+  uint64_t hash = rom_hash(rom_image, rom_image_size);
+  const RomDbEntry *entry = use_rom_db ? rom_db_find(hash) : NULL;
+  unsigned fields = entry != NULL ? entry->fields : 0;
+
+  vip_timing = vip_requested;
+  memset(&quirks, 0, sizeof quirks);
+  if (vip_requested)
   {
-    switch (instruction & 0x00FF)
-    {
-    case 0x0007:
-    {
-      /*
-      Fx07 - LD Vx, DT
-      Set Vx = delay timer value.
+    quirks = vip_quirks;
+  }
+  cpu_hz = CPU_HZ;
+  memcpy(keypad_keys, DEFAULT_KEYPAD_KEYS, sizeof keypad_keys);
+  screen_style.on_color = requested_style.on_color;
+  screen_style.off_color = requested_style.off_color;
 
-      The value of DT is placed into Vx.
-      */
-      registers[(instruction & 0x0F00) >> 8] = delay_timer;
-      break;
-    }
+  if (entry == NULL)
+  {
+    return;
+  }
 
-    case 0x000A:
-    {
-      /*
-      Fx0A - LD Vx, K
-      Wait for a key press, store the value of the key in Vx.
+  if ((fields & ROM_DB_PLATFORM) && !vip_requested)
+  {
+    vip_timing = entry->vip_timing;
+    quirks = entry->quirks;
+  }
+  if (fields & ROM_DB_QUIRKS)
+  {
+    quirks = entry->quirks;
+  }
+  if (fields & ROM_DB_CYCLES)
+  {
+    cpu_hz = entry->cycles_per_frame * TIMER_HZ;
+  }
+  if (fields & ROM_DB_KEYS)
+  {
+    memcpy(keypad_keys, entry->keys, sizeof keypad_keys);
+  }
+  if ((fields & ROM_DB_COLORS) && !colors_requested)
+  {
+    screen_style.on_color = entry->on_color;
+    screen_style.off_color = entry->off_color;
+  }
 
-      All execution stops until a key is pressed, then the value of that key is stored in Vx.
-      */
+  fprintf(stderr, "Using the ROM database entry for %016llx\n", (unsigned long long)hash);
+}
 
-      if (key_pressed == 0)
-      {
-        pc -= 2;
-      }
-      else
-      {
-        // Take the key pressed. Convert it to the chip-8 keyboard. Store in vx
-        // for (int j = 0; j < 17; j++)
-        // {
-        //   if (int_to_ascii[j] == key_pressed)
-        //   {
-        //     registers[(instruction & 0x0F00) >> 8] = j;
-        //   }
-        // }
-        if ((key_pressed >= 48 && key_pressed <= 57) || (key_pressed >= 65 && key_pressed <= 70))
-        {
-          registers[(instruction & 0x0F00) >> 8] = key_pressed;
-        }
-      }
+/*
+Resets the machine and loads rom_image into it, with its settings. The
+window, audio and the emulation thread carry on as they were. Takes
+machine_lock.
+*/
+void restart_rom(void)
+{
+  pthread_mutex_lock(&machine_lock);
+  reset_machine();
+  apply_rom_settings();
+  load_rom_from_memory(rom_image, rom_image_size);
+  pthread_mutex_unlock(&machine_lock);
+}
 
-      break;
-    }
+/*
+The keys that act on the window rather than the Chip-8: fast-forward,
+screenshots, restarting the ROM and the debugger.
+*/
+void handle_window_keys(void)
+{
+  if (IsKeyPressed(TURBO_KEY))
+  {
+    atomic_store(&turbo_enabled, !atomic_load(&turbo_enabled));
+  }
 
-    case 0x0015:
-    {
-      /*
-      Fx15: LD DT, Vx
-      Set delay timer = Vx.
-      */
+  if (IsKeyPressed(SCREENSHOT_KEY))
+  {
+    save_screenshot();
+  }
 
-      delay_timer = registers[(instruction & 0x0F00) >> 8];
+  if (IsKeyPressed(RESET_KEY))
+  {
+    restart_rom();
+  }
 
-      break;
-    }
+  handle_debugger_keys();
+}
 
-    case 0x0018:
-    {
-      /*
-      Fx18 - LD ST, Vx
-      Set sound timer = Vx.
-      */
+/*
+Input-to-present latency, measured by the window thread. A key press gets a
+new window_input_serial and its time is noted. The first frame presented
+after it that ran with that serial and looks different from the frame before
+it ends the measurement.
+*/
+unsigned pending_input_serial = 0;
+double pending_input_time = 0;
+uint64_t last_presented_rows[SCREEN_HEIGHT];
 
-      sound_timer = registers[(instruction & 0x0F00) >> 8];
-      break;
-    }
+/*
+Reads the keyboard into window_keypad, noting the time of any new key press.
+*/
+void read_window_input(void)
+{
+  uint16_t keys = read_keyboard_keypad();
+  uint16_t held = atomic_load_explicit(&window_keypad, memory_order_relaxed);
+
+  atomic_store_explicit(&window_keypad, keys, memory_order_relaxed);
+
+  if ((keys & ~held) == 0)
+  {
+    return;
+  }
+
+  // Release, so whoever sees the serial also sees the keys
+  unsigned serial = atomic_fetch_add_explicit(&window_input_serial, 1, memory_order_release) + 1;
+
+  // While an earlier press is still waiting for its frame, measure from that one
+  double now = host_seconds();
+  if (pending_input_serial == 0 || now - pending_input_time > INPUT_LATENCY_TIMEOUT_SECONDS)
+  {
+    pending_input_serial = serial;
+    pending_input_time = now;
+  }
+}
+
+/*
+Called by the window right after presenting frame.
+*/
+void note_present(const PresentedFrame *frame)
+{
+  bool changed = memcmp(frame->rows, last_presented_rows, sizeof last_presented_rows) != 0;
+  double now = host_seconds();
+
+  if (changed)
+  {
+    memcpy(last_presented_rows, frame->rows, sizeof last_presented_rows);
+  }
+
+  if (pending_input_serial == 0)
+  {
+    return;
+  }
+
+  if (now - pending_input_time > INPUT_LATENCY_TIMEOUT_SECONDS)
+  {
+    pending_input_serial = 0;
+  }
+  else if (changed && (int)(frame->input_serial - pending_input_serial) >= 0)
+  {
+    telemetry_record_input_latency(now - pending_input_time);
+    pending_input_serial = 0;
+  }
+}
+
+/*
+Runs one emulated frame with the keys held in the window and over --shm, and
+publishes it. Adds the cycles it ran to cycles. Returns false without running
+anything if the CPU is paused or faulted.
+
+Takes machine_lock, so the window, the GDB stub and the debugger keys get at
+the machine between frames.
+*/
+bool run_emulation_frame(uint64_t *cycles)
+{
+  static uint64_t frame_number = 0;
+
+  pthread_mutex_lock(&machine_lock);
+
+  unsigned input_serial = atomic_load_explicit(&window_input_serial, memory_order_acquire);
+
+  if (debugger_paused || machine_fault != FAULT_NONE)
+  {
+    // Keep publishing, so the window shows what the debugger changes
+    publish_frame(input_serial);
+    pthread_mutex_unlock(&machine_lock);
+    return false;
+  }
 
-    case 0x001E:
+  shm_export_read_input();
+  keypad = atomic_load_explicit(&window_keypad, memory_order_relaxed) | shm_export_keypad();
+
+  uint64_t frame_start_cycle = cycle_count;
+  run_frame();
+  *cycles += cycle_count - frame_start_cycle;
+
+  if (machine_fault != FAULT_NONE)
+  {
+    fprintf(stderr, "%s\n", debugger_message);
+  }
+  // The core stays quiet, so say here why it stopped
+  else if (debugger_paused)
+  {
+    printf("%s\n", debugger_message);
+  }
+
+  publish_frame(input_serial);
+  shm_export_publish();
+  recorder_capture(frame_number++);
+  pthread_mutex_unlock(&machine_lock);
+  return true;
+}
+
+/*
+The emulation thread. Runs the CPU one emulated frame at a time, paced
+against the host clock (faster when fast-forwarding, not at all when
+unthrottled), and publishes every finished frame.
+*/
+void *emulation_thread(void *arg)
+{
+  (void)arg;
+  double next_frame_time = host_seconds();
+  // Cycles run back to back since the thread last slept
+  uint64_t burst_cycles = 0;
+
+  while (atomic_load(&emulation_running))
+  {
+    if (!run_emulation_frame(&burst_cycles))
     {
-      /*
-      Fx1E - ADD I, Vx
-      Set I = I + Vx.
-      */
-      I = I + registers[(instruction & 0x0F00) >> 8];
-      break;
+      sleep_seconds(EMULATION_PAUSED_SLEEP_NS / 1e9);
+      next_frame_time = host_seconds();
+      continue;
     }
 
-    case 0x0029:
+    bool turbo = atomic_load_explicit(&turbo_enabled, memory_order_relaxed);
+
+    if (turbo && turbo_unthrottled)
     {
-      /*
-      Fx29 - LD F, Vx
-      Set I = location of sprite for digit Vx.
-      */
+      telemetry_record_emulated_frames(1, 0);
+      telemetry_record_burst(burst_cycles);
+      burst_cycles = 0;
+      next_frame_time = host_seconds();
+      continue;
+    }
 
-      // A single char takes this many bytes (font)
-      int character_size_on_disk = 5;
+    double frame_rate = TIMER_HZ * (turbo ? turbo_speed : 1);
+    next_frame_time += 1.0 / frame_rate;
+    double now = host_seconds();
 
-      I = FONT_START_ADDRESS + (character_size_on_disk * (instruction & 0x0F00) >> 8);
+    // Late if the next frame should already have started
+    telemetry_record_emulated_frames(1, now > next_frame_time);
 
-      break;
+    if (now < next_frame_time)
+    {
+      telemetry_record_burst(burst_cycles);
+      burst_cycles = 0;
+      sleep_seconds(next_frame_time - now);
     }
-
-    case 0x0033:
+    else if (now - next_frame_time > EMULATION_MAX_LAG_SECONDS)
     {
-      /*
-      Fx33 - LD B, Vx
-      Store BCD representation of Vx in memory locations I, I+1, and I+2.
-      */
-
-      /*
-      The interpreter takes the decimal value of Vx, and places the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.
-      */
-
-      /*
-      x is an eight-bit number, meaning from 0 to 255.
-      taking the hundredths digit:
-      - modulo by 100
-      */
-      int num = registers[(instruction & 0x0F00) >> 8];
-      int hundredths_digit = floor(num / 100);
-      int tens_digit = floor((num % 100) / 10);
-      int singles_digit = num % 10;
-
-      ram[I] = hundredths_digit;
-      ram[I + 1] = tens_digit;
-      ram[I + 2] = singles_digit;
-
-      break;
+      telemetry_record_frames_dropped((uint64_t)((now - next_frame_time) * frame_rate));
+      telemetry_record_burst(burst_cycles);
+      burst_cycles = 0;
+      next_frame_time = now;
     }
+  }
 
-    case 0x0055:
-    {
-      /*
-      Fx55 - LD [I], Vx
-      Store registers V0 through Vx in memory starting at location I.
-      */
+  return NULL;
+}
 
-      for (int j = 0; j <= ((instruction & 0x0F00) >> 8); j++)
+int main(int argc, char *argv[])
+{
+  char *rom_path = NULL;
+  bool headless = false;
+  uint64_t headless_cycles = 0;
+  int gdb_port = 0;
+  int metrics_port = 0;
+  double stats_interval = 0;
+  char *shm_name = NULL;
+  bool low_latency = false;
+  double frame_delay = 0;
+  int shm_scale = 1;
+  char *record_path = NULL;
+  char *play_path = NULL;
+  bool hot_reload = false;
+  bool print_rom_hash = false;
+  char *rom_db_path = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+    {
+      headless = true;
+      headless_cycles = strtoull(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc)
+    {
+      turbo_speed = atoi(argv[++i]);
+      if (turbo_speed < 1)
       {
-        ram[I + j] = registers[j];
+        turbo_speed = 1;
       }
-
+    }
+    else if (strcmp(argv[i], "--unthrottled") == 0)
+    {
+      turbo_unthrottled = true;
+    }
+    else if (strcmp(argv[i], "--turbo") == 0)
+    {
+      atomic_store(&turbo_enabled, true);
+    }
+    else if (strcmp(argv[i], "--break") == 0 && i + 1 < argc)
+    {
+      toggle_breakpoint(strtol(argv[++i], NULL, 16));
+    }
+    else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc)
+    {
+      add_watchpoint(strtol(argv[++i], NULL, 16), true, true);
+    }
+    else if (strcmp(argv[i], "--gdb") == 0 && i + 1 < argc)
+    {
+      gdb_port = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc)
+    {
+      metrics_port = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc)
+    {
+      stats_interval = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc)
+    {
+      shm_name = argv[++i];
+    }
+    else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+    {
+      record_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc)
+    {
+      play_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--shm-scale") == 0 && i + 1 < argc)
+    {
+      shm_scale = atoi(argv[++i]);
+      if (shm_scale < 1)
+      {
+        shm_scale = 1;
+      }
+    }
+    else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc)
+    {
+      colors_requested = true;
+      if (parse_screen_colors(argv[++i]) != 0)
+      {
+        fprintf(stderr, "--colors takes two hex colors, e.g. --colors 33FF66,002200\n");
+        return 1;
+      }
+    }
+    else if (strcmp(argv[i], "--grid") == 0)
+    {
+      screen_style.grid = true;
+    }
+    else if (strcmp(argv[i], "--low-latency") == 0)
+    {
+      low_latency = true;
+    }
+    else if (strcmp(argv[i], "--frame-delay") == 0 && i + 1 < argc)
+    {
+      low_latency = true;
+      frame_delay = atof(argv[++i]) / 1000;
+      if (frame_delay < 0)
+      {
+        frame_delay = 0;
+      }
+      if (frame_delay > MAX_FRAME_DELAY_SECONDS)
+      {
+        frame_delay = MAX_FRAME_DELAY_SECONDS;
+      }
+    }
+    else if (strcmp(argv[i], "--trap-unknown") == 0)
+    {
+      trap_unknown_opcodes = true;
+    }
+    else if (strcmp(argv[i], "--hot-reload") == 0)
+    {
+      hot_reload = true;
+    }
+    else if (strcmp(argv[i], "--rom-db") == 0 && i + 1 < argc)
+    {
+      rom_db_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "--no-rom-db") == 0)
+    {
+      use_rom_db = false;
+    }
+    else if (strcmp(argv[i], "--rom-hash") == 0)
+    {
+      print_rom_hash = true;
+    }
+    else if (strcmp(argv[i], "--vip") == 0)
+    {
+      vip_requested = true;
+    }
+    else if (strcmp(argv[i], "--debug") == 0)
+    {
+      debugger_paused = true;
+      debugger_overlay_visible = true;
+    }
+    else if (argv[i][0] != '-' && rom_path == NULL)
+    {
+      rom_path = argv[i];
+    }
+    else
+    {
+      rom_path = NULL;
       break;
     }
+  }
+
+  if (play_path != NULL)
+  {
+    return play_recording(play_path);
+  }
+
+  if (rom_path == NULL)
+  {
+    // User specified the wrong arguments
+    printf("Usage: chip8 [--headless <cycles>] [--turbo] [--speed <multiplier>] [--unthrottled] [--low-latency] [--frame-delay <ms>] [--vip] [--trap-unknown] [--debug] [--break <hex_addr>] [--watch <hex_addr>] [--gdb <port>] [--metrics-port <port>] [--stats-interval <seconds>] [--shm <name>] [--shm-scale <n>] [--colors <on_hex>,<off_hex>] [--grid] [--hot-reload] [--rom-db <file>] [--no-rom-db] [--record <file.gif|file.c8r>] <path_to_rom_file>\n"
+           "       chip8 --play <file.c8r>\n"
+           "       chip8 --rom-hash <path_to_rom_file>\n");
+    return 1;
+  }
 
-    case 0x0065:
+  // MEMORY INIT
+  if (read_rom_image(rom_path) != 0)
+  {
+    return 1;
+  }
+
+  if (print_rom_hash)
+  {
+    printf("%016llx\n", (unsigned long long)rom_hash(rom_image, rom_image_size));
+    return 0;
+  }
+
+  // A missing database is only an error if it was asked for by name
+  if (use_rom_db && rom_db_load(rom_db_path != NULL ? rom_db_path : DEFAULT_ROM_DB_PATH) != 0 &&
+      rom_db_path != NULL)
+  {
+    perror("Failed reading the ROM database");
+    return 1;
+  }
+  requested_style = screen_style;
+  restart_rom();
+
+  if (metrics_port != 0 && telemetry_start_server(metrics_port) != 0)
+  {
+    return 1;
+  }
+  if (stats_interval > 0 && telemetry_start_stats_line(stats_interval) != 0)
+  {
+    return 1;
+  }
+
+  if (shm_name != NULL && shm_export_open(shm_name, shm_scale) != 0)
+  {
+    return 1;
+  }
+
+  if (headless)
+  {
+    // Run without a window or audio, as fast as the host allows. Stop early
+    // once the ROM halts, unless keys from --shm could wake it up again
+    uint64_t end_cycle = cycle_count + headless_cycles;
+    halt_detection = shm_name == NULL;
+
+    while (cycle_count < end_cycle && !debugger_paused && machine_fault == FAULT_NONE && !machine_halted)
     {
-      /*
-      Fx65 - LD Vx, [I]
-      Read registers V0 through Vx from memory starting at location I.
-      */
+      uint64_t start_cycle = cycle_count;
+      uint64_t start_tick = timer_tick_count;
+      uint64_t cycles_left = end_cycle - cycle_count;
 
-      /*
-      The interpreter reads values from memory starting at location I into registers V0 through Vx.
-      */
+      shm_export_read_input();
+      keypad = shm_export_keypad();
 
-      for (int j = 0; j <= ((instruction & 0x0F00) >> 8); j++)
+      if (shm_name == NULL)
       {
-        registers[j] = ram[I + j];
+        // In one second chunks, so the telemetry counters move during long runs
+        run_cycles(cycles_left < cpu_hz ? cycles_left : cpu_hz);
       }
+      else
+      {
+        // One frame at a time, like the window, so readers see every frame
+        // and keys are read once per frame
+        run_frame_within(cycles_left);
+      }
+      telemetry_record_instructions(cycle_count - start_cycle);
+      // Never late: headless runs as fast as it can, with no clock to keep up with
+      telemetry_record_emulated_frames(timer_tick_count - start_tick, 0);
 
-      break;
+      if (timer_tick_count != start_tick)
+      {
+        shm_export_publish();
+      }
     }
 
-    default:
-      break;
+    if (debugger_paused)
+    {
+      printf("%s\n", debugger_message);
+    }
+    printf("Ran %llu cycles (%llu timer ticks). PC: 0x%03X I: 0x%03X\n",
+           (unsigned long long)cycle_count, (unsigned long long)timer_tick_count, pc, I);
+    for (int i = 0; i < 16; i++)
+    {
+      printf("V%X: 0x%02X%s", i, registers[i], (i % 8 == 7) ? "\n" : " ");
     }
 
-    break;
-  }
+    shm_export_close();
 
-  default:
-  {
-    break;
-  }
+    if (machine_fault != FAULT_NONE)
+    {
+      printf("Fault: %s at 0x%03X\n", fault_description(machine_fault), fault_pc);
+      return 2;
+    }
+    if (machine_halted)
+    {
+      printf("Halted at 0x%03X\n", halt_pc);
+    }
+    return 0;
   }
-}
 
-int process_instruction(int key_pressed)
-{
-  /*
-  This should fetch, decode, and execute the instruction.
-  */
-  uint16_t instruction = 0;
-  instruction = fetch_instruction_and_increment_pc();
-  execute_instruction(instruction, key_pressed);
-
-  return 1;
-}
+  dump_ram();
 
-int main(int argc, char *argv[])
-{
-  if (argc != 2)
+  if (gdb_port != 0 && gdb_stub_start(gdb_port) != 0)
   {
-    // User specified the wrong number of arguments
-    printf("Usage: chip8 <path_to_rom_file>\n");
     return 1;
   }
 
-  // MEMORY INIT
-  init_ram();
-  load_rom_to_ram(argv[1]);
-  dump_ram();
+  if (hot_reload && rom_watch_start(rom_path) != 0)
+  {
+    return 1;
+  }
 
   // VIDEO INIT
+  // With low latency the swap waits for vsync and this thread paces itself,
+  // so EndDrawing returns as soon as the frame is up instead of sleeping out
+  // the rest of it
+  if (low_latency)
+  {
+    SetConfigFlags(FLAG_VSYNC_HINT);
+  }
   InitWindow(SCREEN_WIDTH * SCREEN_MULTIPLIER,
              SCREEN_HEIGHT * SCREEN_MULTIPLIER, "CHIP-8");
 
-  SetTargetFPS(60);
+  SetTargetFPS(low_latency ? 0 : 60);
+
+  if (record_path != NULL && recorder_start(record_path) != 0)
+  {
+    return 1;
+  }
 
   // AUDIO INIT
   InitAudioDevice();
   Wave tone_wave = LoadWave("assets/tone.wav");
   Sound the_tone = LoadSoundFromWave(tone_wave);
 
-  float timer_acc = 0;
-  float cpu_acc = 0;
-  float current_frame_time = 0;
+  // Normally the CPU runs on its own thread from here on, and this one only
+  // presents. With low latency this thread runs each frame right before
+  // presenting it.
+  pthread_t emulation;
+  if (!low_latency && pthread_create(&emulation, NULL, emulation_thread, NULL) != 0)
+  {
+    perror("Failed starting the emulation thread");
+    return 1;
+  }
+
+  double present_time = host_seconds();
+  FramePacer pacer;
+  frame_pacer_start(&pacer, present_time);
 
   while (!WindowShouldClose())
   {
-    BeginDrawing();
-    current_frame_time = GetFrameTime();
+    float current_frame_time = GetFrameTime();
 
-    // SOUND
-    if (sound_timer > 0)
+    // The new ROM starts on the next emulated frame
+    if (hot_reload && rom_watch_changed())
     {
-      play_tone_if_not_already_playing(the_tone);
+      if (read_rom_image(rom_path) == 0)
+      {
+        restart_rom();
+        printf("Reloaded %s (%zu bytes)\n", rom_path, rom_image_size);
+      }
+      else
+      {
+        fprintf(stderr, "Keeping the ROM that was running\n");
+      }
     }
 
-    // TIMER MGMT
-    timer_acc += current_frame_time;
-
-    while (timer_acc >= (1.0f / 60.0f))
+    // INPUT
+    handle_window_keys();
+    if (!low_latency)
+    {
+      read_window_input();
+    }
+    else
     {
-      timer_acc -= (1.0f / 60.0f);
-      decrease_timers();
+      // Emulated time follows the host clock, not the monitor: sleep until
+      // the next frame is due (and the frame delay after the last present),
+      // then run the frames that are due, which on a fast monitor is often
+      // none. Each runs with the keys looked at again right before it.
+      double frame_rate = TIMER_HZ * (atomic_load(&turbo_enabled) ? turbo_speed : 1);
+      double wake_time = present_time + frame_delay;
+
+      if (wake_time < frame_pacer_next_time(&pacer, frame_rate))
+      {
+        wake_time = frame_pacer_next_time(&pacer, frame_rate);
+      }
+      sleep_seconds(wake_time - host_seconds());
+
+      uint64_t cycles = 0;
+      uint64_t dropped_before = pacer.frames_dropped;
+      int frames = frame_pacer_due(&pacer, host_seconds(), frame_rate);
+
+      telemetry_record_frames_dropped(pacer.frames_dropped - dropped_before);
+      telemetry_record_emulated_frames(frames, 0);
+
+      for (int i = 0; i < frames; i++)
+      {
+        PollInputEvents();
+        handle_window_keys();
+        read_window_input();
+        run_emulation_frame(&cycles);
+      }
+      telemetry_record_burst(cycles);
     }
 
-    // Process instructions at CPU_HZ
-    cpu_acc += current_frame_time;
+    const PresentedFrame *frame = latest_frame();
 
-    while (cpu_acc >= (1.0f / CPU_HZ))
+    // SOUND
+    if (frame->sound_on)
     {
-      // One "CPU" cycle
-      cpu_acc -= (1.0f / CPU_HZ);
-
-      // Process input
-      int key_pressed = GetKeyPressed();
-      // if (key_pressed != 0)
-      // {
-      //   printf("Key pressed: %d\n", key_pressed);
-      // }
-
-      // Process CPU instruction
-      process_instruction(key_pressed);
+      play_tone_if_not_already_playing(the_tone);
     }
 
-    /*
-    // Convert timeElapsed to string
-    char strTimeElapsed[16];
-    snprintf(strTimeElapsed, 16, "%f", timeElapsed);
-    DrawText(strTimeElapsed, 0, 0, 16, RAYWHITE);
-    */
+    BeginDrawing();
     ClearBackground(BLACK);
-    draw_screen();
+    draw_screen(frame->rows);
+
+    sample_emulation_speed(GetTime(), frame->cycle_count);
+    if (atomic_load(&turbo_enabled))
+    {
+      draw_speed_overlay(turbo_speed, turbo_unthrottled);
+    }
+
+    pthread_mutex_lock(&machine_lock);
+    if (debugger_overlay_visible || debugger_paused || machine_fault != FAULT_NONE)
+    {
+      draw_debugger_overlay();
+    }
+    pthread_mutex_unlock(&machine_lock);
 
     EndDrawing();
+    note_present(frame);
+    telemetry_record_frame(current_frame_time);
+
+    present_time = host_seconds();
+  }
+
+  if (!low_latency)
+  {
+    atomic_store(&emulation_running, false);
+    pthread_join(emulation, NULL);
   }
+  telemetry_print_input_latency();
 
+  rom_watch_stop();
+  rom_db_free();
+  recorder_stop();
+  shm_export_close();
   CloseAudioDevice();
+  unload_screen_texture();
   CloseWindow();
   return 0;
 }
@@ -0,0 +1,300 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RAM_SIZE 4096
+// RAM_SIZE is a power of two, so addresses past the end wrap around with a mask
+#define RAM_ADDRESS_MASK (RAM_SIZE - 1)
+// Halt detection hashes RAM in pages, and tracks which ones changed in a uint16_t
+#define RAM_PAGE_SIZE 256
+#define RAM_PAGE_COUNT (RAM_SIZE / RAM_PAGE_SIZE)
+#define STACK_DEPTH 16
+#define CPU_HZ 700
+#define TIMER_HZ 60
+
+/*
+The COSMAC VIP timing model: 1802 machine cycles per 60 Hz frame, of which
+the display DMA and the interrupt routine take about half, leaving the rest
+for the interpreter.
+*/
+#define VIP_MACHINE_CYCLES_PER_FRAME 3668
+#define VIP_DISPLAY_CYCLES 1832
+#define VIP_CYCLES_PER_FRAME (VIP_MACHINE_CYCLES_PER_FRAME - VIP_DISPLAY_CYCLES)
+
+#define FONT_SIZE 80
+#define SCREEN_WIDTH 64
+#define SCREEN_HEIGHT 32
+
+#define ROM_START_ADDRESS 0x200
+#define FONT_START_ADDRESS 0x050
+
+// Defining a byte as being 8 bit
+typedef uint8_t BYTE;
+typedef uint16_t ADDRESS;
+
+/*
+Machine state, defined in core.c.
+*/
+extern BYTE ram[RAM_SIZE];
+extern ADDRESS stack[STACK_DEPTH];
+extern int8_t stack_pointer;
+extern BYTE delay_timer;
+extern BYTE sound_timer;
+extern ADDRESS pc;
+extern ADDRESS I;
+extern BYTE registers[16];
+extern bool pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
+extern uint16_t keypad;
+extern uint64_t cycle_count;
+extern uint64_t timer_tick_count;
+extern bool vip_timing;
+extern uint32_t cpu_hz;
+extern uint32_t rng_state;
+
+/*
+Behaviours that differ between Chip-8 interpreters and that ROMs depend on.
+All off is how this emulator has always run; the COSMAC VIP had most of them
+on. Set them before running a ROM, like vip_timing.
+*/
+typedef struct
+{
+  // 8xy6 and 8xyE shift Vy into Vx, instead of shifting Vx in place
+  bool shift_uses_vy;
+  // Fx55 and Fx65 leave I one past the last register they touched
+  bool load_store_increments_i;
+  // Bxnn jumps to xnn + Vx, instead of Bnnn to nnn + V0
+  bool jump_uses_vx;
+  // 8xy1, 8xy2 and 8xy3 clear VF
+  bool logic_resets_vf;
+  // Sprites are cut off at the edges of the screen instead of wrapping
+  bool sprites_clip;
+} Quirks;
+
+extern Quirks quirks;
+// What the COSMAC VIP did, for --vip and platform=vip in the ROM database
+extern const Quirks vip_quirks;
+
+/*
+Why the machine stopped, if it did. See raise_fault in core.c.
+*/
+typedef enum
+{
+  FAULT_NONE,
+  FAULT_STACK_OVERFLOW,
+  FAULT_STACK_UNDERFLOW,
+  FAULT_UNKNOWN_OPCODE,
+} MachineFault;
+
+extern MachineFault machine_fault;
+extern ADDRESS fault_pc;
+extern bool trap_unknown_opcodes;
+
+const char *fault_description(MachineFault fault);
+
+/*
+Halt detection, for headless runs. Off by default, since in a window a key
+press can always wake the ROM up again. See check_for_halt in core.c.
+*/
+extern bool halt_detection;
+extern bool machine_halted;
+extern ADDRESS halt_pc;
+
+void mark_ram_written(ADDRESS start, int length);
+
+/*
+The machine, defined in core.c.
+*/
+void init_ram(void);
+void reset_machine(void);
+int load_rom_to_ram(char *filename);
+int load_rom_from_memory(const BYTE *rom, size_t size);
+int dump_ram(void);
+uint16_t peek_instruction(ADDRESS address);
+void run_cycles(uint64_t cycles);
+void run_frame(void);
+void run_frame_within(uint64_t max_cycles);
+void pack_screen(uint64_t rows[SCREEN_HEIGHT]);
+
+/*
+A copy of the whole machine, for going back to a known state with a few
+memcpys instead of reloading everything. Debugger state isn't part of it.
+*/
+typedef struct
+{
+  BYTE ram[RAM_SIZE];
+  ADDRESS stack[STACK_DEPTH];
+  BYTE registers[16];
+  bool pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
+  int8_t stack_pointer;
+  BYTE delay_timer;
+  BYTE sound_timer;
+  ADDRESS pc;
+  ADDRESS I;
+  uint16_t keypad;
+  uint64_t cycle_count;
+  uint64_t timer_tick_count;
+  uint32_t vip_frame_cycles;
+  bool vip_waiting_for_vblank;
+  uint32_t rng_state;
+  MachineFault machine_fault;
+  ADDRESS fault_pc;
+  bool machine_halted;
+  ADDRESS halt_pc;
+} MachineSnapshot;
+
+void save_machine(MachineSnapshot *snapshot);
+void restore_machine(const MachineSnapshot *snapshot);
+
+#ifdef CHIP8_COVERAGE
+/*
+Per-PC execution counters, bumped for every instruction process_instruction
+runs. Only built into the fuzzer, which defines the array.
+*/
+extern uint8_t pc_coverage[RAM_SIZE];
+#endif
+
+/*
+Expanding the screen into RGBA pixels, defined in rgba.c. Colors are 32 bit
+words whose bytes are R, G, B and A in memory (on a little-endian host, which
+is all we build for).
+*/
+#define RGBA_COLOR(r, g, b, a) ((uint32_t)(r) | (uint32_t)(g) << 8 | (uint32_t)(b) << 16 | (uint32_t)(a) << 24)
+
+typedef struct
+{
+  uint32_t on_color;
+  uint32_t off_color;
+  // With grid set, the last column and line of each scaled pixel are grid_color
+  bool grid;
+  uint32_t grid_color;
+} ScreenStyle;
+
+typedef enum
+{
+  RGBA_KERNEL_AUTO,
+  RGBA_KERNEL_SCALAR,
+  RGBA_KERNEL_SSE2,
+  RGBA_KERNEL_AVX2,
+} RgbaKernel;
+
+// How the window and every export draw the screen
+extern ScreenStyle screen_style;
+
+void expand_screen_rgba(const uint64_t rows[SCREEN_HEIGHT], int scale, const ScreenStyle *style, uint32_t *out);
+void expand_screen_rgba_using(RgbaKernel kernel, const uint64_t rows[SCREEN_HEIGHT], int scale,
+                              const ScreenStyle *style, uint32_t *out);
+bool rgba_kernel_available(RgbaKernel kernel);
+
+/*
+Held by the emulation thread while it runs a frame. Anything on another
+thread must hold it to touch the machine state.
+*/
+extern pthread_mutex_t machine_lock;
+
+/*
+Debugger, defined in core.c.
+*/
+extern bool debugger_paused;
+extern char debugger_message[64];
+
+bool has_breakpoint(ADDRESS address);
+void set_breakpoint(ADDRESS address, bool enabled);
+void toggle_breakpoint(ADDRESS address);
+void add_watchpoint(ADDRESS address, bool on_read, bool on_write);
+void remove_watchpoint(ADDRESS address, bool on_read, bool on_write);
+void debugger_resume(void);
+void debugger_step(void);
+void debugger_step_over(void);
+
+/*
+GDB remote serial protocol stub, defined in gdb_stub.c.
+*/
+int gdb_stub_start(int port);
+
+/*
+Runtime counters and their exporters, defined in telemetry.c.
+*/
+void telemetry_record_instructions(uint64_t count);
+void telemetry_record_burst(uint64_t cycles);
+void telemetry_record_frame(double frame_seconds);
+void telemetry_record_emulated_frames(uint64_t frames, uint64_t late);
+void telemetry_record_frames_dropped(uint64_t frames);
+void telemetry_record_input_latency(double seconds);
+void telemetry_print_input_latency(void);
+int telemetry_start_server(int port);
+int telemetry_start_stats_line(double interval);
+
+/*
+Pacing emulated frames against the host clock, defined in frame_pacing.c.
+*/
+typedef struct
+{
+  double next_frame_time;
+  // Frames skipped because emulation fell too far behind to catch up
+  uint64_t frames_dropped;
+} FramePacer;
+
+void frame_pacer_start(FramePacer *pacer, double now);
+int frame_pacer_due(FramePacer *pacer, double now, double frame_rate);
+double frame_pacer_next_time(const FramePacer *pacer, double frame_rate);
+
+/*
+Shared memory export of the screen and registers, defined in shm_export.c.
+*/
+int shm_export_open(const char *name, int scale);
+void shm_export_close(void);
+void shm_export_publish(void);
+void shm_export_read_input(void);
+uint16_t shm_export_keypad(void);
+
+/*
+Background recorder of the screen to GIF or .c8r files, defined in
+recorder.c.
+*/
+int recorder_start(const char *filename);
+void recorder_capture(uint64_t frame);
+void recorder_stop(void);
+int recording_open(const char *filename);
+bool recording_next_frame(uint64_t rows[SCREEN_HEIGHT], uint64_t *frame);
+void recording_close(void);
+
+/*
+The ROM database, defined in rom_db.c: per-ROM settings keyed by a hash of
+the ROM's contents. fields says which of the settings the entry has.
+*/
+#define ROM_DB_PLATFORM (1 << 0)
+#define ROM_DB_QUIRKS (1 << 1)
+#define ROM_DB_CYCLES (1 << 2)
+#define ROM_DB_KEYS (1 << 3)
+#define ROM_DB_COLORS (1 << 4)
+
+typedef struct
+{
+  uint64_t hash;
+  unsigned fields;
+  bool vip_timing;
+  Quirks quirks;
+  uint32_t cycles_per_frame;
+  // The host key for each Chip-8 key, '0'-'9' or 'A'-'Z'
+  char keys[16];
+  uint32_t on_color;
+  uint32_t off_color;
+} RomDbEntry;
+
+uint64_t rom_hash(const BYTE *rom, size_t size);
+int rom_db_load(const char *path);
+const RomDbEntry *rom_db_find(uint64_t hash);
+void rom_db_free(void);
+
+/*
+Watching the ROM file for --hot-reload, defined in rom_watch.c.
+*/
+int rom_watch_start(const char *path);
+bool rom_watch_changed(void);
+void rom_watch_stop(void);
+
+#endif
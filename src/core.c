@@ -0,0 +1,1964 @@
+#include "chip8.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+The Chip-8 machine itself: state, instruction set, scheduler and debugger
+core. No raylib in here, so it also builds into the fuzzer on its own.
+*/
+
+BYTE ram[RAM_SIZE];
+
+ADDRESS stack[STACK_DEPTH];
+// Stack pointer that points at the next free slot in the stack
+int8_t stack_pointer = 0;
+
+BYTE delay_timer = 0;
+BYTE sound_timer = 0;
+
+ADDRESS pc = ROM_START_ADDRESS;
+ADDRESS I = 0;
+
+BYTE registers[16]; // 0-F
+
+// Bit n is set while Chip-8 key n is held down
+uint16_t keypad = 0;
+
+bool pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
+
+/*
+Emulated time. cycle_count counts every instruction the CPU has retired,
+including the ones fast-forwarded by the idle-loop detection, so it always
+matches what a plain instruction-by-instruction run would have counted.
+*/
+uint64_t cycle_count = 0;
+uint64_t timer_tick_count = 0;
+// Instructions per second of emulated time. Only change it right after
+// reset_machine, since the timer ticks are worked out from it
+uint32_t cpu_hz = CPU_HZ;
+
+Quirks quirks = {0};
+const Quirks vip_quirks = {
+    .shift_uses_vy = true,
+    .load_store_increments_i = true,
+    .logic_resets_vf = true,
+    .sprites_clip = true,
+};
+
+/*
+The xorshift32 generator behind Cxkk. It's part of the machine like the
+registers are, so a run is the same every time, snapshots bring it back, and
+halt detection doesn't take a ROM waiting on a random number for a stuck one.
+Never 0, which xorshift would stay at.
+*/
+#define RNG_SEED 0x2545F491
+uint32_t rng_state = RNG_SEED;
+
+/*
+COSMAC VIP timing model, off by default. Instructions cost roughly what they
+took on the VIP instead of one cycle each, and the timers tick once the
+frame's budget of machine cycles is spent, or as soon as a Dxyn has to wait
+for the vertical blank.
+
+vip_frame_cycles is how much of the current frame's budget is spent. It can
+end a frame above the budget, and the excess comes out of the next frame.
+*/
+bool vip_timing = false;
+uint32_t vip_frame_cycles = 0;
+bool vip_waiting_for_vblank = false;
+
+/*
+Set when the ROM does something the machine can't carry on from. The run
+loops stop as soon as it's set, with pc (and fault_pc) on the instruction at
+fault, and don't run anything until the machine is reset.
+*/
+MachineFault machine_fault = FAULT_NONE;
+ADDRESS fault_pc = 0;
+// Unknown opcodes are skipped like a no-op unless this is set
+bool trap_unknown_opcodes = false;
+
+/*
+Halt detection. With it on, the run loops stop for good once the ROM can't
+do anything new: it's jumping to itself with the timers run out, or the
+whole machine state repeats. halt_pc is where it was when that was noticed.
+
+The state is hashed once per emulated second and checked for repeats with
+Brent's cycle finding: halt_reference_hash is compared against every
+following hash, and moves up to the latest one after 1, 2, 4, ... checks, so
+a cycle of any length is caught within a few times its length.
+
+RAM is hashed in pages, and only the pages written since their hash was
+taken are hashed again, so a check costs little more than hashing the
+screen and registers.
+*/
+bool halt_detection = false;
+bool machine_halted = false;
+ADDRESS halt_pc = 0;
+
+// Bit n is set when page n of RAM changed since ram_page_hashes[n] was taken
+uint16_t dirty_ram_pages = 0xFFFF;
+uint64_t ram_page_hashes[RAM_PAGE_COUNT];
+
+bool halt_reference_valid = false;
+uint64_t halt_reference_hash = 0;
+uint32_t halt_checks_since_reference = 0;
+uint32_t halt_reference_power = 1;
+
+/*
+Debugger state. Breakpoints and watchpoints are bitmaps with one bit per byte
+of RAM.
+
+run_cycles only looks at any of this when debugger_armed is set, which
+happens when there's at least one breakpoint or watchpoint or a step over in
+progress. Otherwise the run loop is the same as without a debugger.
+*/
+uint8_t breakpoints[RAM_SIZE / 8];
+uint8_t read_watchpoints[RAM_SIZE / 8];
+uint8_t write_watchpoints[RAM_SIZE / 8];
+int breakpoint_count = 0;
+int watchpoint_count = 0;
+
+bool debugger_armed = false;
+bool debugger_paused = false;
+// Set on resume so we don't stop again on the breakpoint we're sitting on
+bool debugger_skip_next_break = false;
+// Set by check_watchpoints, the run loop pauses after the instruction
+bool watchpoint_hit = false;
+
+bool step_over_active = false;
+ADDRESS step_over_address = 0;
+int8_t step_over_stack_pointer = 0;
+
+char debugger_message[64] = "";
+
+pthread_mutex_t machine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  The index of this array will point to the physical scancode.
+  For example, indexing int_to_ascii[0xF] will point to the scancode for V
+*/
+// int int_to_ascii[16] = {
+//     88,         // 0
+//     49, 50, 51, // 1 2 3
+//     81, 87, 69, // 4 5 6
+//     65, 83, 68, // 7 8 9
+//     90, 67, 52, // A B C
+//     82, 70, 86  // D E F
+// };
+
+/*
+Returns a short description of the given fault.
+*/
+const char *fault_description(MachineFault fault)
+{
+  switch (fault)
+  {
+  case FAULT_STACK_OVERFLOW:
+    return "stack overflow";
+  case FAULT_STACK_UNDERFLOW:
+    return "stack underflow";
+  case FAULT_UNKNOWN_OPCODE:
+    return "unknown opcode";
+  default:
+    return "no fault";
+  }
+}
+
+/*
+Called by an instruction that can't run. Stops the machine with pc back on
+that instruction.
+*/
+void raise_fault(MachineFault fault)
+{
+  // The PC was already moved past the instruction when it was fetched
+  pc -= 2;
+  fault_pc = pc;
+  machine_fault = fault;
+  snprintf(debugger_message, sizeof debugger_message, "Fault: %s at 0x%03X", fault_description(fault), pc);
+}
+
+/*
+Called for an opcode that isn't part of the instruction set. Returns true if
+it raised a fault, false if the opcode should just be skipped.
+*/
+bool trap_unknown_opcode(void)
+{
+  if (trap_unknown_opcodes)
+  {
+    raise_fault(FAULT_UNKNOWN_OPCODE);
+  }
+
+  return trap_unknown_opcodes;
+}
+
+int push_to_stack(ADDRESS address)
+{
+  if (stack_pointer >= STACK_DEPTH)
+  {
+    raise_fault(FAULT_STACK_OVERFLOW);
+    return 1;
+  }
+
+  stack[stack_pointer] = address;
+  stack_pointer += 1;
+
+  return 0;
+}
+
+/*
+Pops the return address off the stack. On underflow, raises a fault and
+returns the PC, so the caller stays on the faulting instruction.
+*/
+ADDRESS pop_from_stack()
+{
+  if (stack_pointer == 0)
+  {
+    raise_fault(FAULT_STACK_UNDERFLOW);
+    return pc;
+  }
+
+  stack_pointer -= 1;
+  ADDRESS address = stack[stack_pointer];
+
+  return address;
+}
+
+/*
+Takes the file provided as argument and loads it into ram starting at
+ROM_START_ADDRESS. A ROM that doesn't fit is refused before any of it is
+copied.
+*/
+int load_rom_to_ram(char *filename)
+{
+  FILE *rom = fopen(filename, "rb");
+
+  if (!rom)
+  {
+    perror("ROM not found.");
+    return 1;
+  }
+
+  // One byte more than fits, to tell a ROM that's too large from one that just fits
+  BYTE contents[RAM_SIZE - ROM_START_ADDRESS + 1];
+  size_t size = fread(contents, 1, sizeof contents, rom);
+  bool read_failed = ferror(rom);
+
+  fclose(rom);
+  if (read_failed)
+  {
+    perror("Failed reading the ROM");
+    return 1;
+  }
+
+  return load_rom_from_memory(contents, size);
+}
+
+/*
+Copies a ROM image already in memory into RAM at ROM_START_ADDRESS.
+*/
+int load_rom_from_memory(const BYTE *rom, size_t size)
+{
+  if (size > RAM_SIZE - ROM_START_ADDRESS)
+  {
+    fprintf(stderr, "ROM too large, it must fit in %d bytes.\n", RAM_SIZE - ROM_START_ADDRESS);
+    return 1;
+  }
+
+  memcpy(&ram[ROM_START_ADDRESS], rom, size);
+  mark_ram_written(ROM_START_ADDRESS, RAM_SIZE - ROM_START_ADDRESS);
+  return 0;
+}
+
+/*
+Dumps the contents of the Chip-8 RAM to a file in the root folder.
+
+IMPROVEMENT: Make the filename an argument.
+*/
+int dump_ram(void)
+{
+  FILE *ram_dump = fopen("ram_dump.bin", "w");
+  if (!ram_dump)
+  {
+    perror("Failed creating the file ram_dump.bin");
+    return 1;
+  }
+
+  size_t num_bytes_dumped = fwrite(ram, sizeof ram[0], RAM_SIZE, ram_dump);
+  printf("Dumped %zu bytes out of %d requested.\n", num_bytes_dumped, RAM_SIZE);
+  fclose(ram_dump);
+
+  if (num_bytes_dumped == RAM_SIZE)
+  {
+    return 0;
+  }
+  else
+  {
+    return 1;
+  }
+}
+
+/*
+Zeroes out the Chip-8's RAM.
+
+IMPROVEMENT: Make the ram array an argument. But remember how variables work in C, and how functions only alter a local version of what you pass in. So you may need some pointer stuff.
+
+IMPROVEMENT: Don't rely on the global RAM_SIZE define, measure instead the size of the RAM from within the function.
+*/
+int reset_ram(void)
+{
+  // Blank out memory
+  for (int i = 0; i < RAM_SIZE; i++)
+  {
+    ram[i] = 0;
+  }
+
+  return 0;
+}
+
+/*
+Places font information in RAM, starting at address 0x050.
+
+IMPROVEMENT: Pass the RAM in as argument. Again remember how C passes values.
+
+IMPROVEMENT: Pass the start address in as argument.
+*/
+void burn_font_to_ram(void)
+{
+  int font[FONT_SIZE] = {
+      0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+      0x20, 0x60, 0x20, 0x20, 0x70, // 1
+      0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+      0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+      0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+      0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+      0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+      0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+      0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+      0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+      0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+      0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+      0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+      0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+      0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+      0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+  };
+
+  for (int i = 0; i < FONT_SIZE; i++)
+  {
+    ram[FONT_START_ADDRESS + i] = font[i];
+  }
+}
+
+/*
+Initializes the Chip-8 RAM, making it ready for execution.
+*/
+void init_ram(void)
+{
+  // 0x000 - 0x1FF are reserved by the interpreter. 0x200+ are for the ROM.
+  reset_ram();
+  burn_font_to_ram();
+  mark_ram_written(0, RAM_SIZE);
+}
+
+/*
+Puts the whole machine back to how it is at power on, with an empty RAM
+apart from the font, so a ROM can be loaded again while the emulator keeps
+running. Clears any fault or halt. Breakpoints and watchpoints stay, but a
+step over in progress is dropped.
+*/
+void reset_machine(void)
+{
+  init_ram();
+  memset(stack, 0, sizeof stack);
+  memset(registers, 0, sizeof registers);
+  memset(pixels, 0, sizeof pixels);
+  stack_pointer = 0;
+  delay_timer = 0;
+  sound_timer = 0;
+  pc = ROM_START_ADDRESS;
+  I = 0;
+  cycle_count = 0;
+  timer_tick_count = 0;
+  vip_frame_cycles = 0;
+  vip_waiting_for_vblank = false;
+  rng_state = RNG_SEED;
+  machine_fault = FAULT_NONE;
+  fault_pc = 0;
+  machine_halted = false;
+  halt_pc = 0;
+  halt_reference_valid = false;
+
+  step_over_active = false;
+  debugger_skip_next_break = false;
+  watchpoint_hit = false;
+  debugger_armed = breakpoint_count > 0 || watchpoint_count > 0;
+}
+
+/*
+Returns whether the bit for the given address is set in a debugger bitmap.
+*/
+bool bitmap_test(const uint8_t *bitmap, ADDRESS address)
+{
+  address %= RAM_SIZE;
+  return (bitmap[address >> 3] >> (address & 7)) & 1;
+}
+
+/*
+Sets or clears the bit for the given address in a debugger bitmap.
+*/
+void bitmap_set(uint8_t *bitmap, ADDRESS address, bool value)
+{
+  address %= RAM_SIZE;
+
+  if (value)
+  {
+    bitmap[address >> 3] |= 1 << (address & 7);
+  }
+  else
+  {
+    bitmap[address >> 3] &= ~(1 << (address & 7));
+  }
+}
+
+/*
+The run loop takes the slow, checking path only while this is set.
+*/
+void update_debugger_armed(void)
+{
+  debugger_armed = breakpoint_count > 0 || watchpoint_count > 0 || step_over_active;
+}
+
+/*
+Adds or removes a breakpoint at the given address.
+*/
+void set_breakpoint(ADDRESS address, bool enabled)
+{
+  if (bitmap_test(breakpoints, address) == enabled)
+  {
+    return;
+  }
+
+  bitmap_set(breakpoints, address, enabled);
+  breakpoint_count += enabled ? 1 : -1;
+  update_debugger_armed();
+}
+
+/*
+Returns whether there's a breakpoint at the given address.
+*/
+bool has_breakpoint(ADDRESS address)
+{
+  return bitmap_test(breakpoints, address);
+}
+
+/*
+Adds a breakpoint at the given address, or removes it if there already is one.
+*/
+void toggle_breakpoint(ADDRESS address)
+{
+  set_breakpoint(address, !bitmap_test(breakpoints, address));
+}
+
+/*
+Watches the given RAM address for reads, writes, or both. Watching for
+neither does nothing.
+*/
+void add_watchpoint(ADDRESS address, bool on_read, bool on_write)
+{
+  if (!on_read && !on_write)
+  {
+    return;
+  }
+
+  if (!bitmap_test(read_watchpoints, address) && !bitmap_test(write_watchpoints, address))
+  {
+    watchpoint_count++;
+  }
+
+  if (on_read)
+  {
+    bitmap_set(read_watchpoints, address, true);
+  }
+  if (on_write)
+  {
+    bitmap_set(write_watchpoints, address, true);
+  }
+
+  update_debugger_armed();
+}
+
+/*
+Stops watching the given RAM address for reads, writes, or both.
+*/
+void remove_watchpoint(ADDRESS address, bool on_read, bool on_write)
+{
+  bool was_watched = bitmap_test(read_watchpoints, address) || bitmap_test(write_watchpoints, address);
+
+  if (on_read)
+  {
+    bitmap_set(read_watchpoints, address, false);
+  }
+  if (on_write)
+  {
+    bitmap_set(write_watchpoints, address, false);
+  }
+
+  if (was_watched && !bitmap_test(read_watchpoints, address) && !bitmap_test(write_watchpoints, address))
+  {
+    watchpoint_count--;
+  }
+
+  update_debugger_armed();
+}
+
+/*
+Called by the instructions that access RAM through I (Dxyn, Fx33, Fx55 and
+Fx65) with the range they touch. Flags a hit if any byte in it is watched.
+
+Callers check watchpoint_count first, so this costs nothing without
+watchpoints.
+*/
+void check_watchpoints(ADDRESS start, int length, bool is_write)
+{
+  uint8_t *bitmap = is_write ? write_watchpoints : read_watchpoints;
+
+  for (int i = 0; i < length; i++)
+  {
+    if (bitmap_test(bitmap, start + i))
+    {
+      snprintf(debugger_message, sizeof debugger_message, "Watchpoint: %s 0x%03X",
+               is_write ? "write to" : "read from", (start + i) % RAM_SIZE);
+      watchpoint_hit = true;
+      return;
+    }
+  }
+}
+
+/*
+Tells halt detection that the RAM in the given range changed. The core calls
+it for Fx33 and Fx55. Anything else writing to RAM behind its back (the
+debugger) has to call it too.
+*/
+void mark_ram_written(ADDRESS start, int length)
+{
+  for (int offset = 0; offset < length; offset += RAM_PAGE_SIZE)
+  {
+    dirty_ram_pages |= 1 << (((start + offset) & RAM_ADDRESS_MASK) / RAM_PAGE_SIZE);
+  }
+  dirty_ram_pages |= 1 << (((start + length - 1) & RAM_ADDRESS_MASK) / RAM_PAGE_SIZE);
+}
+
+/*
+Decreases by 1 the sound and delay timers.
+*/
+void decrease_timers(void)
+{
+  if (sound_timer > 0)
+  {
+    sound_timer--;
+  }
+
+  if (delay_timer > 0)
+  {
+    delay_timer--;
+  }
+}
+
+/*
+Returns the instruction in RAM at the current PC. Then increases the PC by 2, so that it points to the next instruction.
+*/
+uint16_t fetch_instruction_and_increment_pc(void)
+{
+  // Instructions are 16 bit
+  uint16_t instruction_high = ram[pc & RAM_ADDRESS_MASK];
+  uint8_t instruction_low = ram[(pc + 1) & RAM_ADDRESS_MASK];
+
+  uint16_t instruction = (instruction_high << 8) | instruction_low;
+
+  pc += 0x002;
+  return instruction;
+}
+
+/*
+Sets all virtual pixels to 0.
+*/
+void clear_background(void)
+{
+  for (int i = 0; i < SCREEN_HEIGHT; i++)
+  {
+    for (int n = 0; n < SCREEN_WIDTH; n++)
+    {
+      pixels[i][n] = false;
+    }
+  }
+}
+
+/*
+Packs the virtual pixels into one 64 bit word per row, the leftmost pixel in
+the most significant bit.
+*/
+void pack_screen(uint64_t rows[SCREEN_HEIGHT])
+{
+  for (int i = 0; i < SCREEN_HEIGHT; i++)
+  {
+    uint64_t row = 0;
+
+    for (int n = 0; n < SCREEN_WIDTH; n++)
+    {
+      row = (row << 1) | pixels[i][n];
+    }
+    rows[i] = row;
+  }
+}
+
+/*
+Copies the machine state into snapshot.
+*/
+void save_machine(MachineSnapshot *snapshot)
+{
+  memcpy(snapshot->ram, ram, sizeof ram);
+  memcpy(snapshot->stack, stack, sizeof stack);
+  memcpy(snapshot->registers, registers, sizeof registers);
+  memcpy(snapshot->pixels, pixels, sizeof pixels);
+  snapshot->stack_pointer = stack_pointer;
+  snapshot->delay_timer = delay_timer;
+  snapshot->sound_timer = sound_timer;
+  snapshot->pc = pc;
+  snapshot->I = I;
+  snapshot->keypad = keypad;
+  snapshot->cycle_count = cycle_count;
+  snapshot->timer_tick_count = timer_tick_count;
+  snapshot->vip_frame_cycles = vip_frame_cycles;
+  snapshot->vip_waiting_for_vblank = vip_waiting_for_vblank;
+  snapshot->rng_state = rng_state;
+  snapshot->machine_fault = machine_fault;
+  snapshot->fault_pc = fault_pc;
+  snapshot->machine_halted = machine_halted;
+  snapshot->halt_pc = halt_pc;
+}
+
+/*
+Puts the machine back in the state saved by save_machine.
+*/
+void restore_machine(const MachineSnapshot *snapshot)
+{
+  memcpy(ram, snapshot->ram, sizeof ram);
+  memcpy(stack, snapshot->stack, sizeof stack);
+  memcpy(registers, snapshot->registers, sizeof registers);
+  memcpy(pixels, snapshot->pixels, sizeof pixels);
+  stack_pointer = snapshot->stack_pointer;
+  delay_timer = snapshot->delay_timer;
+  sound_timer = snapshot->sound_timer;
+  pc = snapshot->pc;
+  I = snapshot->I;
+  keypad = snapshot->keypad;
+  cycle_count = snapshot->cycle_count;
+  timer_tick_count = snapshot->timer_tick_count;
+  vip_frame_cycles = snapshot->vip_frame_cycles;
+  vip_waiting_for_vblank = snapshot->vip_waiting_for_vblank;
+  rng_state = snapshot->rng_state;
+  machine_fault = snapshot->machine_fault;
+  fault_pc = snapshot->fault_pc;
+  machine_halted = snapshot->machine_halted;
+  halt_pc = snapshot->halt_pc;
+
+  // The RAM changed under the page hashes, and the states seen so far don't
+  // lead here any more
+  mark_ram_written(0, RAM_SIZE);
+  halt_reference_valid = false;
+}
+
+/*
+Executes the given instruction.
+*/
+void execute_instruction(uint16_t instruction)
+{
+  switch (instruction & 0xF000)
+  {
+  case 0x0000:
+  {
+    /*
+    00E0 - CLS
+    Clear the display.
+    */
+    if (instruction == 0x00E0)
+    {
+      clear_background();
+      break;
+    }
+    /*
+    00EE - RET
+    Return from a subroutine.
+    */
+    else if (instruction == 0x00EE)
+    {
+      /*
+      Pop the address from the stack and set the PC to it, so we can
+      resume execution.
+      */
+      pc = pop_from_stack();
+      break;
+    }
+
+    // 0nnn - SYS addr, a call to VIP machine code. Ignored.
+    trap_unknown_opcode();
+    break;
+  }
+
+  case 0x1000:
+  {
+    /*
+    nnn - JP addr
+    Jump to location nnn.
+    */
+    pc = (instruction & 0x0FFF);
+    break;
+  }
+
+  case 0x2000:
+  {
+    /*
+    2nnn - CALL addr
+    Call subroutine at nnn.
+    */
+
+    /*
+    In a normal jump, we move the PC to the new instruction, and that's it.
+
+    As this is a jump to subroutine though, this means that at some point we
+    will exit it and resume execution.
+
+    This is where the stack comes into play.
+
+    Before moving the PC to the new location, we push the current location of
+    the PC to the stack. Then, when we return from the subroutine (another
+    opcode), we resume execution as normal.
+
+    So here, just push the current PC to the stack and then jump to the
+    subroutine's address.
+    */
+    if (push_to_stack(pc) == 0)
+    {
+      pc = (instruction & 0x0FFF);
+    }
+
+    break;
+  }
+
+  case 0x3000:
+  {
+    /*
+    3xkk - SE Vx, byte
+    Skip next instruction if Vx = kk
+    */
+    int vx_value = registers[(instruction & 0x0F00) >> 8];
+    int nn = (instruction & 0x00FF);
+
+    if (vx_value == nn)
+    {
+      pc += 2;
+    }
+
+    break;
+  }
+
+  case 0x4000:
+  {
+    /*
+    4xkk - SNE Vx, byte
+    Skip next instruction if Vx != kk
+    */
+    int vx_value = registers[(instruction & 0x0F00) >> 8];
+    int nn = (instruction & 0x00FF);
+
+    if (vx_value != nn)
+    {
+      pc += 2;
+    }
+
+    break;
+  }
+
+  case 0x5000:
+  {
+    /*
+    5xy0 - SE Vx, Vy
+    Skip next instruction if Vx = Vy
+    */
+    if ((instruction & 0x000F) != 0 && trap_unknown_opcode())
+    {
+      break;
+    }
+
+    int vx_value = registers[(instruction & 0x0F00) >> 8];
+    int vy_value = registers[(instruction & 0x00F0) >> 4];
+
+    if (vx_value == vy_value)
+    {
+      pc += 2;
+    }
+
+    break;
+  }
+
+  case 0x6000:
+  {
+    /*
+    6xkk - LD Vx, byte
+    Set Vx = kk
+    */
+    registers[(instruction & 0x0F00) >> 8] = instruction & 0x00FF;
+    break;
+  }
+
+  case 0x7000:
+  {
+    /*
+    7xkk - ADD Vx, byte
+    Adds the value kk to the value of the register Vx, then stores the result in
+    Vx.
+    */
+    registers[(instruction & 0x0F00) >> 8] += instruction & 0x00FF;
+    break;
+  }
+
+  case 0x8000:
+  {
+    int opflag = (instruction & 0x000F);
+    int x = (instruction & 0x0F00) >> 8;
+    int y = (instruction & 0x00F0) >> 4;
+
+    switch (opflag)
+    {
+    case 0x0000:
+    {
+      /*
+      8XY0 - LD Vx, Vy
+      Set Vx = Vy
+      */
+      registers[x] = registers[y];
+      break;
+    }
+
+    case 0x0001:
+    {
+      /*
+      8xy1 - OR Vx, Vy
+      Set Vx = Vx OR Vy
+      */
+      registers[x] = (registers[x] | registers[y]);
+      if (quirks.logic_resets_vf)
+      {
+        registers[0xF] = 0;
+      }
+      break;
+    }
+
+    case 0x0002:
+    {
+      /*
+      8xy2 - AND Vx, Vy
+      Set Vx = Vx AND Vy
+      */
+      registers[x] = (registers[x] & registers[y]);
+      if (quirks.logic_resets_vf)
+      {
+        registers[0xF] = 0;
+      }
+      break;
+    }
+
+    case 0x0003:
+    {
+      /*
+      8xy3 - XOR Vx, Vy
+      Set Vx = Vx XOR Vy
+      */
+      registers[x] = (registers[x] ^ registers[y]);
+      if (quirks.logic_resets_vf)
+      {
+        registers[0xF] = 0;
+      }
+      break;
+    }
+
+    case 0x0004:
+    {
+      /*
+      8xy4 - ADD Vx, Vy
+      Set Vx = Vx + Vy, set VF = carry.
+      */
+
+      /*
+      The value of VX is set to the value of VX + value of XY
+      If the result is larger than 255 (8 bits), only the lowest 8 bits are
+      stored and VF is set to 1. Otherwise, VF is set to 0.
+      */
+      if (registers[x] + registers[y] > 0b11111111)
+      {
+        // Result overflows. Only store lowest 8 bits
+        registers[x] = (registers[x] + registers[y]) & 0b11111111; // I hope this is right
+        registers[0xF] = 1;
+        break;
+      }
+      else
+      { // Result does not overflow
+        registers[x] = registers[x] + registers[y];
+        registers[0xF] = 0;
+        break;
+      }
+    }
+
+    case 0x0005:
+    {
+      /*
+      8xy5 - SUB Vx, Vy
+      Set Vx = Vx - Vy, set VF = NOT borrow.
+      */
+
+      // If Vx >= Vy -> VF = 1, otherwise VF = 0. VF is written last, so the
+      // flag wins when x is F.
+      BYTE not_borrow = registers[x] >= registers[y];
+      registers[x] = registers[x] - registers[y];
+      registers[0xF] = not_borrow;
+      break;
+    }
+
+    case 0x0006:
+    {
+      /*
+      8xy6 - SHR Vx {, Vy}
+      Set Vx = Vx SHR 1.
+      */
+
+      /*
+      Shift right. In case of odd numbers (last bit = 1), we set VF = 1
+
+      Practically:
+      If least-significant bit of Vx is 1, VF = 1. Otherwise, VF = 0.
+      Then, shift Vx 1 to the right (floor divide by 2)
+      */
+      // The VIP shifted Vy into Vx, later interpreters shift Vx in place
+      BYTE source = quirks.shift_uses_vy ? registers[y] : registers[x];
+      BYTE shifted_out = source & 0b00000001;
+      registers[x] = (source >> 1);
+      registers[0xF] = shifted_out;
+      break;
+    }
+
+    case 0x0007:
+    {
+      /*
+      8xy7 - SUBN Vx, Vy
+      Set Vx = Vy - Vx, set VF = NOT borrow.
+      */
+
+      BYTE not_borrow = registers[y] >= registers[x];
+      registers[x] = registers[y] - registers[x];
+      registers[0xF] = not_borrow;
+      break;
+    }
+
+    case 0x000E:
+    {
+      /*
+      8xyE - SHL Vx {, Vy}
+      Set Vx = Vx SHL 1.
+      */
+
+      /*
+      Shift left. If left-most bit is 1, set VF = 1, otherwise VF = 0.
+      */
+      BYTE source = quirks.shift_uses_vy ? registers[y] : registers[x];
+      BYTE shifted_out = source >> 7;
+      registers[x] = (source << 1);
+      registers[0xF] = shifted_out;
+      break;
+    }
+
+    default:
+      trap_unknown_opcode();
+      break;
+    }
+    break;
+  }
+
+  case 0x9000:
+  {
+    /*
+    9xy0 - SNE Vx, Vy
+    Skip next instruction if Vx != Vy.
+    */
+    if ((instruction & 0x000F) != 0 && trap_unknown_opcode())
+    {
+      break;
+    }
+
+    int vx_value = registers[(instruction & 0x0F00) >> 8];
+    int vy_value = registers[(instruction & 0x00F0) >> 4];
+
+    if (vx_value != vy_value)
+    {
+      pc += 2;
+    }
+
+    break;
+  }
+
+  case 0xA000:
+  {
+    /*
+    Annn - LD I, addr
+    Set I = nnn.
+    */
+    I = instruction & 0x0FFF;
+    break;
+  }
+
+  case 0xB000:
+  {
+    /*
+    Bnnn - JP V0, addr
+    Jump to location nnn + V0.
+    */
+
+    // CHIP-48 and SUPER-CHIP read it as Bxnn, adding Vx instead
+    int offset_register = quirks.jump_uses_vx ? (instruction & 0x0F00) >> 8 : 0;
+    pc = (instruction & 0x0FFF) + registers[offset_register];
+    break;
+  }
+
+  case 0xC000:
+  {
+    /*
+    Cxkk - RND Vx, byte
+    Set Vx = random byte AND kk.
+    */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+
+    // The top byte, since xorshift's low bits are its weakest
+    registers[(instruction & 0x0F00) >> 8] = (rng_state >> 24) & (instruction & 0x00FF);
+    break;
+  }
+
+  case 0xD000:
+  {
+    /*
+    Dxyn - DRW Vx, Vy, nibble
+    Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
+    */
+
+    // Draw sprite of N height from memory location at address I at X, Y
+
+    // Get X and Y coords (if they overflow, they should wrap)
+    int x = registers[(instruction & 0x0F00) >> 8] % SCREEN_WIDTH;
+    int y = registers[(instruction & 0x00F0) >> 4] % SCREEN_HEIGHT;
+
+    int sprite_height = (instruction & 0x000F);
+    // With sprites_clip, only the part of the sprite that's on screen is drawn
+    int drawn_height = sprite_height;
+    int drawn_width = 8;
+
+    if (quirks.sprites_clip)
+    {
+      drawn_height = y + sprite_height > SCREEN_HEIGHT ? SCREEN_HEIGHT - y : sprite_height;
+      drawn_width = x + 8 > SCREEN_WIDTH ? SCREEN_WIDTH - x : 8;
+    }
+
+    if (watchpoint_count > 0)
+    {
+      check_watchpoints(I, sprite_height, false);
+    }
+
+    // Reset collision flag
+    registers[0xF] = 0;
+
+    // For each sprite row
+    for (int n = 0; n < drawn_height; n++)
+    {
+      uint8_t sprite_row = ram[(I + n) & RAM_ADDRESS_MASK];
+      // That's something like 11110000
+
+      for (int p = 0; p < drawn_width; p++)
+      {
+        // For each bit in the row, we get a single "pixel" (l to r)
+
+        // Sliding mask to get one bit ("pixel") at a time
+        uint8_t mask = 0b10000000 >> p;
+        /*
+        p: 0
+        spriteRow: 11110000
+        mask:      10000000
+
+        pixelToDraw: 10000000 >> (7-p) --> 00000001
+        */
+        bool pixel_to_draw = (sprite_row & mask) >> (7 - p);
+        if (pixel_to_draw)
+        {
+          bool pixel_on_screen = pixels[(y + n) % SCREEN_HEIGHT][(x + p) % SCREEN_WIDTH];
+
+          /*
+          If pixel on screen is 1, and we flip it to 0, set VF to 1.
+          Otherwise, set it to 0.
+          */
+          if (pixel_to_draw && pixel_on_screen)
+          {
+            registers[0xF] = 1;
+          }
+
+          /*
+          This pixel needs to be drawn on screen.
+          We flip the pixel on screen.
+          */
+          pixels[(y + n) % SCREEN_HEIGHT][(x + p) % SCREEN_WIDTH] = !pixel_on_screen;
+        }
+      }
+    }
+
+    // The VIP only draws during the vertical blank, so nothing else runs
+    // until the next frame
+    if (vip_timing)
+    {
+      vip_waiting_for_vblank = true;
+    }
+
+    break;
+  }
+
+  case 0xE000:
+  {
+    switch (instruction & 0x00FF)
+    {
+    case 0x009E:
+    {
+      /*
+      Ex9E - SKP Vx
+      Skip next instruction if key with the value of Vx is pressed.
+      */
+
+      /*
+      Checks the keyboard, and if the key corresponding to the value of Vx is currently in the down position, PC is increased by 2.
+      */
+
+      if (keypad & (1 << (registers[((instruction & 0x0F00) >> 8)] & 0xF)))
+      {
+        pc += 2;
+      }
+
+      break;
+    }
+
+    case 0x00A1:
+    {
+      /*
+      ExA1 - SKNP Vx
+      Skip next instruction if key with the value of Vx is not pressed.
+      */
+
+      /*
+      Checks the keyboard, and if the key corresponding to the value of Vx is currently in the up position, PC is increased by 2.
+      */
+
+      if (!(keypad & (1 << (registers[((instruction & 0x0F00) >> 8)] & 0xF))))
+      {
+        pc += 2;
+      }
+
+      break;
+    }
+
+    default:
+      trap_unknown_opcode();
+      break;
+    }
+
+    break;
+  }
+
+  case 0xF000:
+  {
+    switch (instruction & 0x00FF)
+    {
+    case 0x0007:
+    {
+      /*
+      Fx07 - LD Vx, DT
+      Set Vx = delay timer value.
+
+      The value of DT is placed into Vx.
+      */
+      registers[(instruction & 0x0F00) >> 8] = delay_timer;
+      break;
+    }
+
+    case 0x000A:
+    {
+      /*
+      Fx0A - LD Vx, K
+      Wait for a key press, store the value of the key in Vx.
+
+      All execution stops until a key is pressed, then the value of that key is stored in Vx.
+      */
+
+      if (keypad == 0)
+      {
+        pc -= 2;
+      }
+      else
+      {
+        // Store the lowest key held down
+        BYTE key = 0;
+        while (!(keypad & (1 << key)))
+        {
+          key++;
+        }
+        registers[(instruction & 0x0F00) >> 8] = key;
+      }
+
+      break;
+    }
+
+    case 0x0015:
+    {
+      /*
+      Fx15: LD DT, Vx
+      Set delay timer = Vx.
+      */
+
+      delay_timer = registers[(instruction & 0x0F00) >> 8];
+
+      break;
+    }
+
+    case 0x0018:
+    {
+      /*
+      Fx18 - LD ST, Vx
+      Set sound timer = Vx.
+      */
+
+      sound_timer = registers[(instruction & 0x0F00) >> 8];
+      break;
+    }
+
+    case 0x001E:
+    {
+      /*
+      Fx1E - ADD I, Vx
+      Set I = I + Vx.
+      */
+      I = I + registers[(instruction & 0x0F00) >> 8];
+      break;
+    }
+
+    case 0x0029:
+    {
+      /*
+      Fx29 - LD F, Vx
+      Set I = location of sprite for digit Vx.
+      */
+
+      // A single char takes this many bytes (font)
+      int character_size_on_disk = 5;
+
+      // Only the low nibble of Vx picks a digit
+      I = FONT_START_ADDRESS + character_size_on_disk * (registers[(instruction & 0x0F00) >> 8] & 0xF);
+
+      break;
+    }
+
+    case 0x0033:
+    {
+      /*
+      Fx33 - LD B, Vx
+      Store BCD representation of Vx in memory locations I, I+1, and I+2.
+      */
+
+      /*
+      The interpreter takes the decimal value of Vx, and places the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.
+      */
+
+      /*
+      x is an eight-bit number, meaning from 0 to 255.
+      taking the hundredths digit:
+      - modulo by 100
+      */
+      int num = registers[(instruction & 0x0F00) >> 8];
+      int hundredths_digit = floor(num / 100);
+      int tens_digit = floor((num % 100) / 10);
+      int singles_digit = num % 10;
+
+      if (watchpoint_count > 0)
+      {
+        check_watchpoints(I, 3, true);
+      }
+
+      ram[I & RAM_ADDRESS_MASK] = hundredths_digit;
+      ram[(I + 1) & RAM_ADDRESS_MASK] = tens_digit;
+      ram[(I + 2) & RAM_ADDRESS_MASK] = singles_digit;
+      mark_ram_written(I, 3);
+
+      break;
+    }
+
+    case 0x0055:
+    {
+      /*
+      Fx55 - LD [I], Vx
+      Store registers V0 through Vx in memory starting at location I.
+      */
+
+      if (watchpoint_count > 0)
+      {
+        check_watchpoints(I, ((instruction & 0x0F00) >> 8) + 1, true);
+      }
+
+      for (int j = 0; j <= ((instruction & 0x0F00) >> 8); j++)
+      {
+        ram[(I + j) & RAM_ADDRESS_MASK] = registers[j];
+      }
+      mark_ram_written(I, ((instruction & 0x0F00) >> 8) + 1);
+
+      if (quirks.load_store_increments_i)
+      {
+        I += ((instruction & 0x0F00) >> 8) + 1;
+      }
+
+      break;
+    }
+
+    case 0x0065:
+    {
+      /*
+      Fx65 - LD Vx, [I]
+      Read registers V0 through Vx from memory starting at location I.
+      */
+
+      /*
+      The interpreter reads values from memory starting at location I into registers V0 through Vx.
+      */
+
+      if (watchpoint_count > 0)
+      {
+        check_watchpoints(I, ((instruction & 0x0F00) >> 8) + 1, false);
+      }
+
+      for (int j = 0; j <= ((instruction & 0x0F00) >> 8); j++)
+      {
+        registers[j] = ram[(I + j) & RAM_ADDRESS_MASK];
+      }
+
+      if (quirks.load_store_increments_i)
+      {
+        I += ((instruction & 0x0F00) >> 8) + 1;
+      }
+
+      break;
+    }
+
+    default:
+      trap_unknown_opcode();
+      break;
+    }
+
+    break;
+  }
+
+  default:
+  {
+    break;
+  }
+  }
+}
+
+int process_instruction(void)
+{
+  /*
+  This should fetch, decode, and execute the instruction.
+  */
+  uint16_t instruction = 0;
+#ifdef CHIP8_COVERAGE
+  // Saturate, so a hot loop doesn't wrap back to looking like a cold one
+  if (pc_coverage[pc & RAM_ADDRESS_MASK] != 0xFF)
+  {
+    pc_coverage[pc & RAM_ADDRESS_MASK]++;
+  }
+#endif
+  instruction = fetch_instruction_and_increment_pc();
+  execute_instruction(instruction);
+
+  return 1;
+}
+
+/*
+Returns the number of cycles left before the timers are decremented again.
+
+Timer tick k happens at cycle ceil(k * cpu_hz / TIMER_HZ), which keeps the
+timers at exactly 60 Hz of emulated time even though cpu_hz need not be a
+multiple of it.
+*/
+uint64_t cycles_until_timer_tick(void)
+{
+  uint64_t next_tick_cycle = ((timer_tick_count + 1) * cpu_hz + TIMER_HZ - 1) / TIMER_HZ;
+
+  return next_tick_cycle - cycle_count;
+}
+
+/*
+Reads the instruction at the given address without touching the PC.
+*/
+uint16_t peek_instruction(ADDRESS address)
+{
+  return (ram[address & RAM_ADDRESS_MASK] << 8) | ram[(address + 1) & RAM_ADDRESS_MASK];
+}
+
+/*
+Checks whether the CPU is sitting in a loop that can't make any progress
+before the next timer tick or key press. If so, returns how many instructions
+one iteration of that loop takes. Otherwise returns 0.
+
+The patterns recognised are:
+- 1nnn jumping to itself.
+- Fx0A waiting for a key while no key is pressed (it re-executes itself).
+- Fx07 / 3x00 / 1nnn back to the Fx07, while the delay timer is running.
+*/
+int idle_loop_length(void)
+{
+  uint16_t instruction = peek_instruction(pc);
+
+  if ((instruction & 0xF000) == 0x1000 && (instruction & 0x0FFF) == pc)
+  {
+    return 1;
+  }
+
+  if ((instruction & 0xF0FF) == 0xF00A && keypad == 0)
+  {
+    return 1;
+  }
+
+  if ((instruction & 0xF0FF) == 0xF007 && delay_timer > 0)
+  {
+    uint16_t x = instruction & 0x0F00;
+
+    if (peek_instruction(pc + 2) == (0x3000 | x) &&
+        peek_instruction(pc + 4) == (0x1000 | pc))
+    {
+      return 3;
+    }
+  }
+
+  return 0;
+}
+
+/*
+Returns whether the run loops have to stop: the debugger paused the CPU, or
+the machine faulted or halted.
+*/
+bool cpu_stopped(void)
+{
+  return debugger_paused || machine_fault != FAULT_NONE || machine_halted;
+}
+
+/*
+Mixes size bytes (a multiple of 8) into hash, a 64 bit word at a time. Each
+step is a bijection of the hash, so two runs that differ in a single word
+never hash the same.
+*/
+uint64_t hash_words(uint64_t hash, const void *data, size_t size)
+{
+  const uint8_t *bytes = data;
+
+  for (size_t i = 0; i < size; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof word);
+    hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+    hash ^= hash >> 29;
+  }
+
+  return hash;
+}
+
+/*
+Hashes everything that decides what the machine does next, except the cycle
+count. Only the RAM pages written since the last call are hashed again.
+*/
+uint64_t hash_machine_state(void)
+{
+  uint64_t hash = 0;
+
+  for (int page = 0; page < RAM_PAGE_COUNT; page++)
+  {
+    if (dirty_ram_pages & (1 << page))
+    {
+      ram_page_hashes[page] = hash_words(page, &ram[page * RAM_PAGE_SIZE], RAM_PAGE_SIZE);
+    }
+    hash = hash_words(hash, &ram_page_hashes[page], sizeof ram_page_hashes[page]);
+  }
+  dirty_ram_pages = 0;
+
+  uint64_t scalars[3] = {
+      pc | (uint64_t)I << 16 | (uint64_t)(uint8_t)stack_pointer << 32 |
+          (uint64_t)delay_timer << 40 | (uint64_t)sound_timer << 48,
+      keypad | (uint64_t)vip_waiting_for_vblank << 16 | (uint64_t)vip_frame_cycles << 32,
+      rng_state,
+  };
+
+  hash = hash_words(hash, scalars, sizeof scalars);
+  hash = hash_words(hash, registers, sizeof registers);
+  hash = hash_words(hash, stack, sizeof stack);
+  hash = hash_words(hash, pixels, sizeof pixels);
+
+  return hash;
+}
+
+/*
+Stops the machine for good, with halt_pc where it was.
+*/
+void halt_machine(void)
+{
+  machine_halted = true;
+  halt_pc = pc;
+  snprintf(debugger_message, sizeof debugger_message, "Halted at 0x%03X", pc);
+}
+
+/*
+Halts the machine if its state repeats one seen before. Called on every
+TIMER_HZth timer tick, so the states compared are always at the same point of
+the timer schedule, and a match means everything from there on repeats too.
+*/
+void check_for_halt(void)
+{
+  uint64_t hash = hash_machine_state();
+
+  if (halt_reference_valid && hash == halt_reference_hash)
+  {
+    halt_machine();
+    return;
+  }
+
+  if (!halt_reference_valid)
+  {
+    halt_reference_power = 1;
+  }
+  else if (++halt_checks_since_reference < halt_reference_power)
+  {
+    return;
+  }
+  else
+  {
+    halt_reference_power *= 2;
+  }
+
+  halt_reference_valid = true;
+  halt_reference_hash = hash;
+  halt_checks_since_reference = 0;
+}
+
+/*
+One tick of the 60 Hz timers.
+*/
+void timer_tick(void)
+{
+  decrease_timers();
+  timer_tick_count++;
+
+  if (halt_detection && timer_tick_count % TIMER_HZ == 0)
+  {
+    check_for_halt();
+  }
+}
+
+/*
+Returns whether the debugger wants to stop before the instruction at pc runs.
+*/
+bool debugger_should_break(void)
+{
+  if (debugger_skip_next_break)
+  {
+    debugger_skip_next_break = false;
+    return false;
+  }
+
+  if (step_over_active && pc == step_over_address && stack_pointer == step_over_stack_pointer)
+  {
+    step_over_active = false;
+    update_debugger_armed();
+    snprintf(debugger_message, sizeof debugger_message, "Stepped over to 0x%03X", pc);
+    return true;
+  }
+
+  if (breakpoint_count > 0 && bitmap_test(breakpoints, pc))
+  {
+    snprintf(debugger_message, sizeof debugger_message, "Breakpoint at 0x%03X", pc);
+    return true;
+  }
+
+  return false;
+}
+
+/*
+The checking counterpart of the inner loop of run_cycles, used while the
+debugger is armed. Runs up to budget instructions, without any idle-loop
+fast-forwarding, and pauses on breakpoints and watchpoints.
+
+Returns the number of instructions executed.
+*/
+uint64_t run_instructions_with_debugger(uint64_t budget)
+{
+  uint64_t executed = 0;
+
+  while (executed < budget)
+  {
+    if (debugger_should_break())
+    {
+      debugger_paused = true;
+      break;
+    }
+
+    process_instruction();
+
+    if (machine_fault != FAULT_NONE)
+    {
+      break;
+    }
+
+    executed++;
+
+    if (watchpoint_hit)
+    {
+      watchpoint_hit = false;
+      debugger_paused = true;
+      break;
+    }
+  }
+
+  return executed;
+}
+
+/*
+Approximate cost of an instruction on the COSMAC VIP, in 1802 machine cycles
+(8 clocks each), including the interpreter's fetch and decode. Close enough
+for ROMs tuned to the VIP to run at their intended pace, not cycle exact.
+
+skipped says whether a skip instruction took the skip.
+*/
+uint32_t vip_instruction_cost(uint16_t instruction, bool skipped)
+{
+  int x = (instruction & 0x0F00) >> 8;
+  uint32_t skip = skipped ? 8 : 0;
+
+  switch (instruction & 0xF000)
+  {
+  case 0x0000:
+    return instruction == 0x00E0 ? 1048 : 50;
+  case 0x1000:
+    return 52;
+  case 0x2000:
+    return 66;
+  case 0x3000:
+  case 0x4000:
+    return 50 + skip;
+  case 0x5000:
+  case 0x9000:
+    return 54 + skip;
+  case 0x6000:
+    return 46;
+  case 0x7000:
+    return 50;
+  case 0x8000:
+    return 84;
+  case 0xA000:
+    return 52;
+  case 0xB000:
+    return 62;
+  case 0xC000:
+    return 76;
+  case 0xD000:
+  {
+    // Sprites not aligned to a byte are shifted into two bytes per row
+    uint32_t rows = instruction & 0x000F;
+    return 108 + rows * (registers[x] % 8 == 0 ? 48 : 64);
+  }
+  case 0xE000:
+    return 54 + skip;
+  default:
+    switch (instruction & 0x00FF)
+    {
+    case 0x0033:
+    {
+      // The VIP gets each digit by repeated subtraction
+      int value = registers[x];
+      return 124 + 16 * (value / 100 + (value / 10) % 10 + value % 10);
+    }
+    case 0x0055:
+    case 0x0065:
+      return 54 + 14 * (x + 1);
+    case 0x001E:
+    case 0x0029:
+      return 56;
+    default:
+      return 50;
+    }
+  }
+}
+
+/*
+Returns whether the current VIP frame is over: its budget is spent, or a
+Dxyn is waiting for the vertical blank.
+*/
+bool vip_frame_over(void)
+{
+  return vip_frame_cycles >= VIP_CYCLES_PER_FRAME || vip_waiting_for_vblank;
+}
+
+/*
+Ends the current VIP frame and ticks the timers.
+*/
+void vip_end_frame(void)
+{
+  // Whatever the interpreter overspent comes out of the next frame, but a
+  // vblank wait throws the rest of the frame away
+  vip_frame_cycles = vip_waiting_for_vblank ? 0 : vip_frame_cycles - VIP_CYCLES_PER_FRAME;
+  vip_waiting_for_vblank = false;
+
+  timer_tick();
+}
+
+/*
+run_cycles for the VIP timing model. Runs one instruction at a time, charging
+each its VIP cost. No idle-loop fast-forwarding.
+*/
+void run_vip_cycles(uint64_t cycles)
+{
+  uint64_t end_cycle = cycle_count + cycles;
+
+  while (cycle_count < end_cycle && !cpu_stopped())
+  {
+    if (vip_frame_over())
+    {
+      vip_end_frame();
+      continue;
+    }
+
+    // Same fixed point check as run_cycles, which would otherwise take the
+    // state hashes a long while to catch here, with the frame budget's carry
+    // going round
+    if (halt_detection && delay_timer == 0 && sound_timer == 0 && idle_loop_length() == 1)
+    {
+      halt_machine();
+      return;
+    }
+
+    uint16_t instruction = peek_instruction(pc);
+    ADDRESS next_pc = pc + 2;
+    // Fx33 depends on Vx and Dxyn on Vx, so cost it before it runs
+    uint32_t cost = vip_instruction_cost(instruction, false);
+    uint64_t executed = 1;
+
+    if (debugger_armed)
+    {
+      executed = run_instructions_with_debugger(1);
+    }
+    else
+    {
+      process_instruction();
+      executed = machine_fault == FAULT_NONE;
+    }
+
+    if (executed > 0)
+    {
+      if (pc == (ADDRESS)(next_pc + 2))
+      {
+        cost = vip_instruction_cost(instruction, true);
+      }
+      vip_frame_cycles += cost;
+      cycle_count += executed;
+    }
+  }
+}
+
+/*
+Runs the CPU for the given number of cycles, decrementing the timers at
+TIMER_HZ of emulated time along the way.
+
+The keys held are whatever is in keypad for the whole run.
+
+Idle loops (see idle_loop_length) are fast-forwarded up to the next timer tick
+or the end of the run, whichever comes first, in whole iterations so the PC
+ends up exactly where a normal run would have left it.
+
+Returns early if the debugger pauses the CPU or the machine faults or halts.
+*/
+void run_cycles(uint64_t cycles)
+{
+  if (vip_timing)
+  {
+    run_vip_cycles(cycles);
+    return;
+  }
+
+  uint64_t end_cycle = cycle_count + cycles;
+
+  while (cycle_count < end_cycle && !cpu_stopped())
+  {
+    uint64_t until_tick = cycles_until_timer_tick();
+
+    if (until_tick == 0)
+    {
+      timer_tick();
+      continue;
+    }
+
+    uint64_t budget = end_cycle - cycle_count;
+    if (until_tick < budget)
+    {
+      budget = until_tick;
+    }
+
+    if (debugger_armed)
+    {
+      cycle_count += run_instructions_with_debugger(budget);
+      continue;
+    }
+
+    while (budget > 0)
+    {
+      int loop_length = idle_loop_length();
+
+      if (loop_length > 0 && budget >= (uint64_t)loop_length)
+      {
+        // A one instruction loop with the timers run out is a fixed point
+        if (halt_detection && loop_length == 1 && delay_timer == 0 && sound_timer == 0)
+        {
+          halt_machine();
+          return;
+        }
+
+        uint64_t skipped = budget - budget % loop_length;
+
+        if (loop_length == 3)
+        {
+          // The skipped Fx07s would have left the delay timer in Vx
+          registers[(peek_instruction(pc) & 0x0F00) >> 8] = delay_timer;
+        }
+
+        cycle_count += skipped;
+        budget -= skipped;
+        continue;
+      }
+
+      process_instruction();
+
+      // A faulting instruction doesn't retire
+      if (machine_fault != FAULT_NONE)
+      {
+        return;
+      }
+
+      cycle_count++;
+      budget--;
+    }
+  }
+}
+
+/*
+Runs the CPU for one 60 Hz frame of emulated time: up to the next timer
+tick, and the tick itself. With the VIP timing model, that's until the frame's
+budget is spent or a Dxyn waits for the vertical blank.
+*/
+void run_frame(void)
+{
+  run_frame_within(UINT64_MAX);
+}
+
+/*
+run_frame, but running at most max_cycles. If they run out first, the frame
+is left unfinished and the next call carries on with it.
+*/
+void run_frame_within(uint64_t max_cycles)
+{
+  uint64_t start_cycle = cycle_count;
+
+  if (vip_timing)
+  {
+    while (!vip_frame_over() && !cpu_stopped() && cycle_count - start_cycle < max_cycles)
+    {
+      run_vip_cycles(1);
+    }
+
+    if (vip_frame_over() && !cpu_stopped())
+    {
+      vip_end_frame();
+    }
+    return;
+  }
+
+  uint64_t until_tick = cycles_until_timer_tick();
+  run_cycles(until_tick < max_cycles ? until_tick : max_cycles);
+
+  if (cycles_until_timer_tick() == 0 && !cpu_stopped())
+  {
+    timer_tick();
+  }
+}
+
+/*
+Lets the CPU run again after a pause.
+*/
+void debugger_resume(void)
+{
+  debugger_paused = false;
+  // Only the armed path consumes this, so don't leave it lying around
+  debugger_skip_next_break = debugger_armed;
+  // A fault stays until the machine is reset, and so does its message
+  if (machine_fault == FAULT_NONE)
+  {
+    debugger_message[0] = '\0';
+  }
+}
+
+/*
+Runs exactly one instruction and pauses again.
+*/
+void debugger_step(void)
+{
+  debugger_resume();
+  run_cycles(1);
+
+  if (!debugger_paused)
+  {
+    debugger_paused = true;
+
+    if (machine_fault == FAULT_NONE)
+    {
+      snprintf(debugger_message, sizeof debugger_message, "Stepped to 0x%03X", pc);
+    }
+  }
+}
+
+/*
+Like debugger_step, except a 2nnn runs the whole subroutine and pauses once it
+returns to the instruction after the call.
+*/
+void debugger_step_over(void)
+{
+  if ((peek_instruction(pc) & 0xF000) != 0x2000)
+  {
+    debugger_step();
+    return;
+  }
+
+  step_over_active = true;
+  step_over_address = pc + 2;
+  step_over_stack_pointer = stack_pointer;
+  update_debugger_armed();
+  debugger_resume();
+}
+
@@ -0,0 +1,57 @@
+#include "chip8.h"
+
+/*
+Paces emulated frames against the host clock, for --low-latency, where the
+window thread runs each frame itself and presents at whatever rate the
+monitor refreshes. Emulated time keeps its own clock here: each present runs
+the frames that came due since the last one, which is none on a fast monitor
+and more than one on a slow one, so the game runs at 60 Hz whatever the
+refresh rate.
+*/
+
+/*
+A frame counts as due this much of a frame early, so presents jittering
+around the frame boundary on a 60 Hz monitor don't alternate between running
+none and two. The clock itself never moves early, so the rate stays exact.
+*/
+#define FRAME_PACER_EARLY_FRACTION 0.25
+// Falling further behind than this drops the backlog instead of running it all
+#define FRAME_PACER_MAX_LAG_SECONDS 0.1
+
+void frame_pacer_start(FramePacer *pacer, double now)
+{
+  pacer->next_frame_time = now;
+  pacer->frames_dropped = 0;
+}
+
+/*
+Returns how many frames at frame_rate per second are due at host time now,
+and takes them off the clock.
+*/
+int frame_pacer_due(FramePacer *pacer, double now, double frame_rate)
+{
+  double period = 1.0 / frame_rate;
+  double lag = now - pacer->next_frame_time;
+  int due = 0;
+
+  if (lag > FRAME_PACER_MAX_LAG_SECONDS)
+  {
+    pacer->frames_dropped += (uint64_t)(lag / period);
+    pacer->next_frame_time = now;
+  }
+
+  while (now + FRAME_PACER_EARLY_FRACTION * period >= pacer->next_frame_time)
+  {
+    pacer->next_frame_time += period;
+    due++;
+  }
+  return due;
+}
+
+/*
+The host time the next frame comes due at, for sleeping until then.
+*/
+double frame_pacer_next_time(const FramePacer *pacer, double frame_rate)
+{
+  return pacer->next_frame_time - FRAME_PACER_EARLY_FRACTION / frame_rate;
+}
@@ -0,0 +1,716 @@
+#include "chip8.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+A GDB remote serial protocol stub, serving one debugger at a time on
+127.0.0.1.
+
+It runs on its own thread and only touches the machine while holding
+machine_lock, which the emulation thread releases between frames, i.e. at an
+instruction boundary. While the debugger lets the CPU run, this thread just
+waits on the socket, so the emulation runs at full speed.
+
+Registers, in the order of the 'g' packet (multi-byte ones are big-endian like
+the rest of the Chip-8):
+  0-15  V0-VF  8 bit
+  16    I      16 bit
+  17    pc     16 bit
+  18    sp     8 bit
+  19    dt     8 bit
+  20    st     8 bit
+*/
+
+#define GDB_PACKET_SIZE 4096
+#define GDB_REGISTER_COUNT 21
+// How often to check whether the CPU stopped while the debugger waits on it
+#define GDB_POLL_MS 10
+
+static const char target_xml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\"><feature name=\"org.chip8.core\">"
+    "<reg name=\"v0\" bitsize=\"8\"/><reg name=\"v1\" bitsize=\"8\"/>"
+    "<reg name=\"v2\" bitsize=\"8\"/><reg name=\"v3\" bitsize=\"8\"/>"
+    "<reg name=\"v4\" bitsize=\"8\"/><reg name=\"v5\" bitsize=\"8\"/>"
+    "<reg name=\"v6\" bitsize=\"8\"/><reg name=\"v7\" bitsize=\"8\"/>"
+    "<reg name=\"v8\" bitsize=\"8\"/><reg name=\"v9\" bitsize=\"8\"/>"
+    "<reg name=\"va\" bitsize=\"8\"/><reg name=\"vb\" bitsize=\"8\"/>"
+    "<reg name=\"vc\" bitsize=\"8\"/><reg name=\"vd\" bitsize=\"8\"/>"
+    "<reg name=\"ve\" bitsize=\"8\"/><reg name=\"vf\" bitsize=\"8\"/>"
+    "<reg name=\"i\" bitsize=\"16\" type=\"data_ptr\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "<reg name=\"sp\" bitsize=\"8\"/>"
+    "<reg name=\"dt\" bitsize=\"8\"/>"
+    "<reg name=\"st\" bitsize=\"8\"/>"
+    "</feature></target>";
+
+static int listen_socket = -1;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f')
+  {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F')
+  {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/*
+Appends value as size bytes of big-endian hex to out.
+*/
+static char *put_hex(char *out, unsigned value, int size)
+{
+  for (int i = (size * 2) - 1; i >= 0; i--)
+  {
+    *out++ = hex_digits[(value >> (i * 4)) & 0xF];
+  }
+  return out;
+}
+
+/*
+Reads size bytes of big-endian hex from in. Returns -1 on malformed input.
+*/
+static long get_hex(const char *in, int size)
+{
+  long value = 0;
+
+  for (int i = 0; i < size * 2; i++)
+  {
+    int digit = hex_value(in[i]);
+    if (digit < 0)
+    {
+      return -1;
+    }
+    value = (value << 4) | digit;
+  }
+  return value;
+}
+
+/*
+Size in bytes of register number n, as laid out above.
+*/
+static int register_size(int n)
+{
+  return (n == 16 || n == 17) ? 2 : 1;
+}
+
+static unsigned read_register(int n)
+{
+  if (n < 16)
+  {
+    return registers[n];
+  }
+
+  switch (n)
+  {
+  case 16:
+    return I;
+  case 17:
+    return pc;
+  case 18:
+    return (BYTE)stack_pointer;
+  case 19:
+    return delay_timer;
+  default:
+    return sound_timer;
+  }
+}
+
+static void write_register(int n, unsigned value)
+{
+  if (n < 16)
+  {
+    registers[n] = value;
+    return;
+  }
+
+  switch (n)
+  {
+  case 16:
+    I = value;
+    break;
+  case 17:
+    pc = value % RAM_SIZE;
+    break;
+  case 18:
+    stack_pointer = value <= STACK_DEPTH ? value : STACK_DEPTH;
+    break;
+  case 19:
+    delay_timer = value;
+    break;
+  default:
+    sound_timer = value;
+    break;
+  }
+}
+
+/*
+Sends data as a "$data#checksum" packet. Returns 0 on success.
+*/
+static int send_packet(int client, const char *data)
+{
+  size_t length = strlen(data);
+  char *packet = malloc(length + 5);
+  BYTE checksum = 0;
+
+  if (!packet)
+  {
+    return 1;
+  }
+
+  for (size_t i = 0; i < length; i++)
+  {
+    checksum += (BYTE)data[i];
+  }
+
+  packet[0] = '$';
+  memcpy(packet + 1, data, length);
+  packet[length + 1] = '#';
+  put_hex(packet + length + 2, checksum, 1);
+
+  ssize_t sent = send(client, packet, length + 4, 0);
+  free(packet);
+
+  return sent == (ssize_t)(length + 4) ? 0 : 1;
+}
+
+/*
+Reads the next packet into buffer, acknowledging it. Returns the packet
+length, -1 on disconnect, or -2 if the debugger sent an interrupt (Ctrl-C)
+outside of a packet.
+*/
+static int receive_packet(int client, char *buffer, int size)
+{
+  char c;
+
+  // Until a packet comes through with a good checksum, asking again for bad ones
+  while (true)
+  {
+    // Skip acks and anything else until the start of a packet
+    do
+    {
+      if (recv(client, &c, 1, 0) != 1)
+      {
+        return -1;
+      }
+      if (c == 0x03)
+      {
+        return -2;
+      }
+    } while (c != '$');
+
+    int length = 0;
+    BYTE checksum = 0;
+
+    while (true)
+    {
+      if (recv(client, &c, 1, 0) != 1)
+      {
+        return -1;
+      }
+      if (c == '#')
+      {
+        break;
+      }
+      if (length < size - 1)
+      {
+        buffer[length++] = c;
+      }
+      checksum += (BYTE)c;
+    }
+    buffer[length] = '\0';
+
+    char sent_checksum[2];
+    if (recv(client, sent_checksum, 2, MSG_WAITALL) != 2)
+    {
+      return -1;
+    }
+
+    if (get_hex(sent_checksum, 1) == checksum)
+    {
+      send(client, "+", 1, 0);
+      return length;
+    }
+    send(client, "-", 1, 0);
+  }
+}
+
+/*
+The stop reply for why the CPU is stopped: SIGILL for an unknown opcode,
+SIGSEGV for a stack fault, SIGTRAP for everything else. Call with
+machine_lock held.
+*/
+static const char *stop_reply(void)
+{
+  switch (machine_fault)
+  {
+  case FAULT_NONE:
+    return "S05";
+  case FAULT_UNKNOWN_OPCODE:
+    return "S04";
+  default:
+    return "S0b";
+  }
+}
+
+/*
+Lets the CPU run until it stops (breakpoint, watchpoint, fault, F5 in the
+window) or the debugger interrupts it. Returns the stop reply to send, or NULL if the
+debugger went away.
+*/
+static const char *continue_until_stopped(int client)
+{
+  pthread_mutex_lock(&machine_lock);
+  debugger_resume();
+  pthread_mutex_unlock(&machine_lock);
+
+  struct pollfd socket_poll = {.fd = client, .events = POLLIN};
+
+  while (true)
+  {
+    if (poll(&socket_poll, 1, GDB_POLL_MS) > 0)
+    {
+      char c;
+      if (recv(client, &c, 1, 0) != 1)
+      {
+        return NULL;
+      }
+
+      if (c == 0x03)
+      {
+        pthread_mutex_lock(&machine_lock);
+        debugger_paused = true;
+        snprintf(debugger_message, sizeof debugger_message, "Interrupted by GDB at 0x%03X", pc);
+        pthread_mutex_unlock(&machine_lock);
+        return "S02";
+      }
+    }
+
+    pthread_mutex_lock(&machine_lock);
+    bool stopped = debugger_paused || machine_fault != FAULT_NONE;
+    const char *reply = stop_reply();
+    pthread_mutex_unlock(&machine_lock);
+
+    if (stopped)
+    {
+      return reply;
+    }
+  }
+}
+
+/*
+Handles Z/z packets: "Z<type>,<addr>,<kind>". Types 0 and 1 are breakpoints,
+2 write, 3 read and 4 access watchpoints.
+*/
+static const char *handle_breakpoint_packet(const char *packet, bool insert)
+{
+  int type = packet[1] - '0';
+  char *end;
+  long address = strtol(packet + 3, &end, 16);
+
+  if (packet[2] != ',' || *end != ',' || address < 0 || address >= RAM_SIZE)
+  {
+    return "E01";
+  }
+
+  pthread_mutex_lock(&machine_lock);
+  switch (type)
+  {
+  case 0:
+  case 1:
+    set_breakpoint(address, insert);
+    break;
+  case 2:
+  case 3:
+  case 4:
+  {
+    bool on_read = type != 2;
+    bool on_write = type != 3;
+
+    if (insert)
+    {
+      add_watchpoint(address, on_read, on_write);
+    }
+    else
+    {
+      remove_watchpoint(address, on_read, on_write);
+    }
+    break;
+  }
+  default:
+    pthread_mutex_unlock(&machine_lock);
+    return "";
+  }
+  pthread_mutex_unlock(&machine_lock);
+
+  return "OK";
+}
+
+/*
+Handles one packet and writes the reply into reply. Returns false once the
+debugger detaches or kills the session.
+*/
+static bool handle_packet(int client, char *packet, char *reply)
+{
+  reply[0] = '\0';
+
+  switch (packet[0])
+  {
+  case '?':
+    pthread_mutex_lock(&machine_lock);
+    strcpy(reply, stop_reply());
+    pthread_mutex_unlock(&machine_lock);
+    break;
+
+  case 'g':
+  {
+    char *out = reply;
+
+    pthread_mutex_lock(&machine_lock);
+    for (int n = 0; n < GDB_REGISTER_COUNT; n++)
+    {
+      out = put_hex(out, read_register(n), register_size(n));
+    }
+    pthread_mutex_unlock(&machine_lock);
+    *out = '\0';
+    break;
+  }
+
+  case 'G':
+  {
+    const char *in = packet + 1;
+
+    pthread_mutex_lock(&machine_lock);
+    for (int n = 0; n < GDB_REGISTER_COUNT && *in; n++)
+    {
+      long value = get_hex(in, register_size(n));
+      if (value < 0)
+      {
+        break;
+      }
+      write_register(n, value);
+      in += register_size(n) * 2;
+    }
+    pthread_mutex_unlock(&machine_lock);
+    strcpy(reply, "OK");
+    break;
+  }
+
+  case 'p':
+  {
+    int n = strtol(packet + 1, NULL, 16);
+
+    if (n < 0 || n >= GDB_REGISTER_COUNT)
+    {
+      strcpy(reply, "E01");
+      break;
+    }
+
+    pthread_mutex_lock(&machine_lock);
+    *put_hex(reply, read_register(n), register_size(n)) = '\0';
+    pthread_mutex_unlock(&machine_lock);
+    break;
+  }
+
+  case 'P':
+  {
+    char *end;
+    int n = strtol(packet + 1, &end, 16);
+    long value = (*end == '=' && n >= 0 && n < GDB_REGISTER_COUNT) ? get_hex(end + 1, register_size(n)) : -1;
+
+    if (value < 0)
+    {
+      strcpy(reply, "E01");
+      break;
+    }
+
+    pthread_mutex_lock(&machine_lock);
+    write_register(n, value);
+    pthread_mutex_unlock(&machine_lock);
+    strcpy(reply, "OK");
+    break;
+  }
+
+  case 'm':
+  {
+    char *end;
+    long address = strtol(packet + 1, &end, 16);
+    long length = (*end == ',') ? strtol(end + 1, NULL, 16) : -1;
+
+    if (address < 0 || length < 0 || address + length > RAM_SIZE || length * 2 >= GDB_PACKET_SIZE)
+    {
+      strcpy(reply, "E01");
+      break;
+    }
+
+    char *out = reply;
+    pthread_mutex_lock(&machine_lock);
+    for (long i = 0; i < length; i++)
+    {
+      out = put_hex(out, ram[address + i], 1);
+    }
+    pthread_mutex_unlock(&machine_lock);
+    *out = '\0';
+    break;
+  }
+
+  case 'M':
+  {
+    char *end;
+    long address = strtol(packet + 1, &end, 16);
+    long length = (*end == ',') ? strtol(end + 1, &end, 16) : -1;
+
+    if (address < 0 || length < 0 || address + length > RAM_SIZE || *end != ':' ||
+        (long)strlen(end + 1) < length * 2)
+    {
+      strcpy(reply, "E01");
+      break;
+    }
+
+    // Decode it all first, so a bad digit leaves RAM alone
+    BYTE bytes[RAM_SIZE];
+    bool valid = true;
+    for (long i = 0; i < length && valid; i++)
+    {
+      long value = get_hex(end + 1 + i * 2, 1);
+      valid = value >= 0;
+      bytes[i] = value;
+    }
+    if (!valid)
+    {
+      strcpy(reply, "E01");
+      break;
+    }
+
+    pthread_mutex_lock(&machine_lock);
+    memcpy(&ram[address], bytes, length);
+    mark_ram_written(address, length);
+    pthread_mutex_unlock(&machine_lock);
+    strcpy(reply, "OK");
+    break;
+  }
+
+  case 'Z':
+  case 'z':
+    strcpy(reply, handle_breakpoint_packet(packet, packet[0] == 'Z'));
+    break;
+
+  case 's':
+    pthread_mutex_lock(&machine_lock);
+    debugger_step();
+    strcpy(reply, stop_reply());
+    pthread_mutex_unlock(&machine_lock);
+    break;
+
+  case 'c':
+  {
+    const char *stopped = continue_until_stopped(client);
+
+    if (stopped == NULL)
+    {
+      return false;
+    }
+    strcpy(reply, stopped);
+    break;
+  }
+
+  case 'H':
+    strcpy(reply, "OK");
+    break;
+
+  case 'D':
+    send_packet(client, "OK");
+    return false;
+
+  case 'k':
+    return false;
+
+  case 'q':
+    if (strncmp(packet, "qSupported", 10) == 0)
+    {
+      snprintf(reply, GDB_PACKET_SIZE, "PacketSize=%x;qXfer:features:read+", GDB_PACKET_SIZE);
+    }
+    else if (strcmp(packet, "qAttached") == 0)
+    {
+      strcpy(reply, "1");
+    }
+    else if (strcmp(packet, "qC") == 0)
+    {
+      strcpy(reply, "QC1");
+    }
+    else if (strcmp(packet, "qfThreadInfo") == 0)
+    {
+      strcpy(reply, "m1");
+    }
+    else if (strcmp(packet, "qsThreadInfo") == 0)
+    {
+      strcpy(reply, "l");
+    }
+    else if (strncmp(packet, "qXfer:features:read:target.xml:", 31) == 0)
+    {
+      char *end;
+      long offset = strtol(packet + 31, &end, 16);
+      long length = (*end == ',') ? strtol(end + 1, NULL, 16) : 0;
+      long total = sizeof target_xml - 1;
+
+      if (offset >= total)
+      {
+        strcpy(reply, "l");
+      }
+      else
+      {
+        if (length > GDB_PACKET_SIZE - 2)
+        {
+          length = GDB_PACKET_SIZE - 2;
+        }
+        if (length > total - offset)
+        {
+          length = total - offset;
+        }
+        reply[0] = (offset + length < total) ? 'm' : 'l';
+        memcpy(reply + 1, target_xml + offset, length);
+        reply[length + 1] = '\0';
+      }
+    }
+    break;
+
+  default:
+    // Empty reply: not supported
+    break;
+  }
+
+  return true;
+}
+
+/*
+Serves one debugger session. The CPU is stopped when the debugger attaches
+and let go again when it detaches.
+*/
+static void serve_client(int client)
+{
+  char *packet = malloc(GDB_PACKET_SIZE);
+  char *reply = malloc(GDB_PACKET_SIZE + 1);
+
+  if (!packet || !reply)
+  {
+    free(packet);
+    free(reply);
+    return;
+  }
+
+  pthread_mutex_lock(&machine_lock);
+  debugger_paused = true;
+  snprintf(debugger_message, sizeof debugger_message, "GDB attached at 0x%03X", pc);
+  pthread_mutex_unlock(&machine_lock);
+
+  while (true)
+  {
+    int length = receive_packet(client, packet, GDB_PACKET_SIZE);
+
+    if (length == -1)
+    {
+      break;
+    }
+    if (length == -2)
+    {
+      // Interrupt while already stopped
+      send_packet(client, "S02");
+      continue;
+    }
+
+    if (!handle_packet(client, packet, reply))
+    {
+      break;
+    }
+    send_packet(client, reply);
+  }
+
+  pthread_mutex_lock(&machine_lock);
+  debugger_resume();
+  pthread_mutex_unlock(&machine_lock);
+
+  free(packet);
+  free(reply);
+}
+
+static void *gdb_stub_thread(void *arg)
+{
+  (void)arg;
+
+  while (true)
+  {
+    int client = accept(listen_socket, NULL, NULL);
+
+    if (client < 0)
+    {
+      continue;
+    }
+
+    printf("GDB connected.\n");
+    serve_client(client);
+    close(client);
+    printf("GDB disconnected.\n");
+  }
+
+  return NULL;
+}
+
+/*
+Starts listening for a debugger on 127.0.0.1 at the given port, on a
+background thread. Returns 0 on success.
+*/
+int gdb_stub_start(int port)
+{
+  struct sockaddr_in address = {0};
+  int reuse = 1;
+
+  listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_socket < 0)
+  {
+    perror("Failed creating the GDB socket");
+    return 1;
+  }
+
+  setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+
+  if (bind(listen_socket, (struct sockaddr *)&address, sizeof address) != 0 ||
+      listen(listen_socket, 1) != 0)
+  {
+    perror("Failed listening for GDB");
+    close(listen_socket);
+    return 1;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, gdb_stub_thread, NULL) != 0)
+  {
+    perror("Failed starting the GDB thread");
+    close(listen_socket);
+    return 1;
+  }
+  pthread_detach(thread);
+
+  printf("Waiting for GDB on 127.0.0.1:%d\n", port);
+  return 0;
+}
@@ -0,0 +1,573 @@
+#include "chip8.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+Records the screen to a file without ever blocking the emulation.
+
+The main loop packs the screen and, if it changed since the last capture,
+pushes it into a single-producer single-consumer ring. A background thread
+pops frames and encodes them. If the writer falls behind (slow disk) and the
+ring fills up, frames are dropped and counted instead of waiting.
+
+Two formats, picked by the file extension:
+- .gif: an animated GIF in the screen's colors, LZW-encoded.
+- anything else: .c8r, the compact format below, which `chip8 --play` reads.
+
+.c8r layout: the 4 bytes "C8R1", then one record per changed frame:
+  varint  frames since the previous record (LEB128)
+  ops     (skip, count, count bytes) triples of unsigned bytes, until the 256
+          bytes of the frame are covered. skip bytes are unchanged, the count
+          bytes that follow are XORed into the previous frame.
+A frame is its 32 rows of 8 bytes each, leftmost pixels in the first byte.
+*/
+
+// Must be a power of two
+#define RECORDER_QUEUE_SIZE 256
+#define RECORDER_IDLE_SLEEP_NS 5000000
+#define RECORDER_GIF_SCALE 4
+// How long the last frame of a GIF stays up, in centiseconds
+#define RECORDER_GIF_LAST_DELAY 100
+#define FRAME_BYTES (SCREEN_HEIGHT * SCREEN_WIDTH / 8)
+
+typedef struct
+{
+  uint64_t frame;
+  uint64_t rows[SCREEN_HEIGHT];
+} RecordedFrame;
+
+static RecordedFrame queue[RECORDER_QUEUE_SIZE];
+// head is only written by the main loop, tail only by the writer thread
+static atomic_size_t queue_head;
+static atomic_size_t queue_tail;
+static atomic_bool writer_running;
+static atomic_uint_fast64_t frames_dropped;
+
+static bool recording = false;
+static bool have_last_capture = false;
+static uint64_t last_capture[SCREEN_HEIGHT];
+static pthread_t writer_thread;
+
+static FILE *output = NULL;
+static bool output_is_gif = false;
+
+// Writer thread state
+static uint8_t previous_frame_bytes[FRAME_BYTES];
+static uint64_t previous_frame_number = 0;
+static bool have_pending_gif_frame = false;
+static RecordedFrame pending_gif_frame;
+
+/*
+Serializes packed rows into frame bytes, leftmost pixels first.
+*/
+static void rows_to_bytes(const uint64_t rows[SCREEN_HEIGHT], uint8_t bytes[FRAME_BYTES])
+{
+  for (int y = 0; y < SCREEN_HEIGHT; y++)
+  {
+    for (int b = 0; b < 8; b++)
+    {
+      bytes[y * 8 + b] = rows[y] >> (56 - b * 8);
+    }
+  }
+}
+
+static void bytes_to_rows(const uint8_t bytes[FRAME_BYTES], uint64_t rows[SCREEN_HEIGHT])
+{
+  for (int y = 0; y < SCREEN_HEIGHT; y++)
+  {
+    rows[y] = 0;
+    for (int b = 0; b < 8; b++)
+    {
+      rows[y] = (rows[y] << 8) | bytes[y * 8 + b];
+    }
+  }
+}
+
+static void write_varint(uint64_t value)
+{
+  do
+  {
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    fputc(value ? byte | 0x80 : byte, output);
+  } while (value);
+}
+
+/*
+Appends one .c8r record: the frame XORed against the previous one, as
+skip/literal runs.
+*/
+static void write_c8r_frame(const RecordedFrame *frame)
+{
+  uint8_t bytes[FRAME_BYTES];
+  uint8_t delta[FRAME_BYTES];
+
+  rows_to_bytes(frame->rows, bytes);
+  for (int i = 0; i < FRAME_BYTES; i++)
+  {
+    delta[i] = bytes[i] ^ previous_frame_bytes[i];
+  }
+
+  write_varint(frame->frame - previous_frame_number);
+
+  int position = 0;
+  while (position < FRAME_BYTES)
+  {
+    int skip = 0;
+    while (position < FRAME_BYTES && delta[position] == 0 && skip < 255)
+    {
+      skip++;
+      position++;
+    }
+
+    int literal_start = position;
+    int count = 0;
+    while (position < FRAME_BYTES && delta[position] != 0 && count < 255)
+    {
+      count++;
+      position++;
+    }
+
+    fputc(skip, output);
+    fputc(count, output);
+    fwrite(delta + literal_start, 1, count, output);
+  }
+
+  memcpy(previous_frame_bytes, bytes, FRAME_BYTES);
+  previous_frame_number = frame->frame;
+}
+
+/*
+GIF output. LZW codes are packed LSB first into sub-blocks of up to 255
+bytes.
+*/
+typedef struct
+{
+  uint8_t block[255];
+  int block_length;
+  uint32_t bits;
+  int bit_count;
+} GifBitWriter;
+
+static void gif_put_byte(GifBitWriter *writer, uint8_t byte)
+{
+  writer->block[writer->block_length++] = byte;
+
+  if (writer->block_length == 255)
+  {
+    fputc(255, output);
+    fwrite(writer->block, 1, 255, output);
+    writer->block_length = 0;
+  }
+}
+
+static void gif_put_code(GifBitWriter *writer, int code, int size)
+{
+  writer->bits |= (uint32_t)code << writer->bit_count;
+  writer->bit_count += size;
+
+  while (writer->bit_count >= 8)
+  {
+    gif_put_byte(writer, writer->bits & 0xFF);
+    writer->bits >>= 8;
+    writer->bit_count -= 8;
+  }
+}
+
+static void gif_finish_codes(GifBitWriter *writer)
+{
+  if (writer->bit_count > 0)
+  {
+    gif_put_byte(writer, writer->bits & 0xFF);
+  }
+  if (writer->block_length > 0)
+  {
+    fputc(writer->block_length, output);
+    fwrite(writer->block, 1, writer->block_length, output);
+  }
+  fputc(0, output);
+}
+
+/*
+Writes the GIF header. The color table is screen_style's off, on and grid
+colors, in that order, plus an unused fourth entry.
+*/
+static void gif_write_header(void)
+{
+  int width = SCREEN_WIDTH * RECORDER_GIF_SCALE;
+  int height = SCREEN_HEIGHT * RECORDER_GIF_SCALE;
+  const uint32_t colors[4] = {screen_style.off_color, screen_style.on_color, screen_style.grid_color, 0};
+  uint8_t palette[12];
+
+  for (int i = 0; i < 4; i++)
+  {
+    palette[i * 3] = colors[i] & 0xFF;
+    palette[i * 3 + 1] = (colors[i] >> 8) & 0xFF;
+    palette[i * 3 + 2] = (colors[i] >> 16) & 0xFF;
+  }
+  const uint8_t loop_forever[19] = {0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E',
+                                    '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00};
+
+  fwrite("GIF89a", 1, 6, output);
+  fputc(width & 0xFF, output);
+  fputc(width >> 8, output);
+  fputc(height & 0xFF, output);
+  fputc(height >> 8, output);
+  // Global color table with 4 entries, background color 0, square pixels
+  fputc(0x81, output);
+  fputc(0, output);
+  fputc(0, output);
+  fwrite(palette, 1, sizeof palette, output);
+  fwrite(loop_forever, 1, sizeof loop_forever, output);
+}
+
+/*
+Writes one full GIF frame that stays up for delay centiseconds.
+*/
+static void gif_write_frame(const RecordedFrame *frame, int delay)
+{
+  // Codes 0-3 are the colors, then clear 4 and end 5
+  const int min_code_size = 2;
+  const int clear_code = 1 << min_code_size;
+  static uint16_t children[4096][4];
+  // The frame scaled up, with color table indices for colors
+  static uint32_t indices[SCREEN_HEIGHT * RECORDER_GIF_SCALE][SCREEN_WIDTH * RECORDER_GIF_SCALE];
+  const ScreenStyle index_style = {.on_color = 1, .off_color = 0, .grid = screen_style.grid, .grid_color = 2};
+
+  int width = SCREEN_WIDTH * RECORDER_GIF_SCALE;
+  int height = SCREEN_HEIGHT * RECORDER_GIF_SCALE;
+
+  // Graphic control extension: leave the frame in place, then wait
+  const uint8_t control[8] = {0x21, 0xF9, 0x04, 0x04, delay & 0xFF, delay >> 8, 0x00, 0x00};
+  fwrite(control, 1, sizeof control, output);
+
+  // Image descriptor covering the whole screen, no local color table
+  const uint8_t descriptor[10] = {0x2C, 0, 0, 0, 0, width & 0xFF, width >> 8, height & 0xFF, height >> 8, 0};
+  fwrite(descriptor, 1, sizeof descriptor, output);
+  fputc(min_code_size, output);
+
+  GifBitWriter writer = {0};
+  int code_size = min_code_size + 1;
+  int max_code = clear_code + 1;
+  int current = -1;
+
+  expand_screen_rgba(frame->rows, RECORDER_GIF_SCALE, &index_style, &indices[0][0]);
+  memset(children, 0, sizeof children);
+  gif_put_code(&writer, clear_code, code_size);
+
+  for (int y = 0; y < height; y++)
+  {
+    for (int x = 0; x < width; x++)
+    {
+      int pixel = indices[y][x];
+
+      if (current < 0)
+      {
+        current = pixel;
+        continue;
+      }
+
+      if (children[current][pixel] != 0)
+      {
+        current = children[current][pixel];
+        continue;
+      }
+
+      gif_put_code(&writer, current, code_size);
+      children[current][pixel] = ++max_code;
+
+      if (max_code >= (1 << code_size))
+      {
+        code_size++;
+      }
+
+      if (max_code == 4095)
+      {
+        gif_put_code(&writer, clear_code, code_size);
+        memset(children, 0, sizeof children);
+        code_size = min_code_size + 1;
+        max_code = clear_code + 1;
+      }
+
+      current = pixel;
+    }
+  }
+
+  gif_put_code(&writer, current, code_size);
+
+  // The decoder adds an entry for that last code too, and may move up a size
+  if (max_code + 1 >= (1 << code_size) && code_size < 12)
+  {
+    code_size++;
+  }
+  gif_put_code(&writer, clear_code + 1, code_size);
+  gif_finish_codes(&writer);
+}
+
+/*
+GIF delays go before the image, so each frame is held back until the next
+one arrives and we know how long it stayed up.
+*/
+static void gif_queue_frame(const RecordedFrame *frame)
+{
+  if (have_pending_gif_frame)
+  {
+    // Difference of rounded timestamps, so rounding errors don't add up
+    uint64_t start = (pending_gif_frame.frame * 100 + TIMER_HZ / 2) / TIMER_HZ;
+    uint64_t end = (frame->frame * 100 + TIMER_HZ / 2) / TIMER_HZ;
+    uint64_t delay = end - start;
+
+    gif_write_frame(&pending_gif_frame, delay > 0xFFFF ? 0xFFFF : (int)delay);
+  }
+
+  pending_gif_frame = *frame;
+  have_pending_gif_frame = true;
+}
+
+static void *recorder_writer_thread(void *arg)
+{
+  (void)arg;
+  const struct timespec idle_sleep = {0, RECORDER_IDLE_SLEEP_NS};
+
+  while (true)
+  {
+    size_t tail = atomic_load_explicit(&queue_tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue_head, memory_order_acquire);
+
+    if (tail == head)
+    {
+      if (!atomic_load(&writer_running))
+      {
+        break;
+      }
+      nanosleep(&idle_sleep, NULL);
+      continue;
+    }
+
+    const RecordedFrame *frame = &queue[tail % RECORDER_QUEUE_SIZE];
+    if (output_is_gif)
+    {
+      gif_queue_frame(frame);
+    }
+    else
+    {
+      write_c8r_frame(frame);
+    }
+
+    atomic_store_explicit(&queue_tail, tail + 1, memory_order_release);
+  }
+
+  if (output_is_gif)
+  {
+    if (have_pending_gif_frame)
+    {
+      gif_write_frame(&pending_gif_frame, RECORDER_GIF_LAST_DELAY);
+    }
+    fputc(0x3B, output);
+  }
+
+  fclose(output);
+  return NULL;
+}
+
+/*
+Starts recording to the given file. Returns 0 on success.
+*/
+int recorder_start(const char *filename)
+{
+  const char *extension = strrchr(filename, '.');
+
+  output = fopen(filename, "wb");
+  if (!output)
+  {
+    perror("Failed creating the recording");
+    return 1;
+  }
+
+  output_is_gif = extension != NULL && strcmp(extension, ".gif") == 0;
+  if (output_is_gif)
+  {
+    gif_write_header();
+  }
+  else
+  {
+    fwrite("C8R1", 1, 4, output);
+  }
+
+  memset(previous_frame_bytes, 0, sizeof previous_frame_bytes);
+  previous_frame_number = 0;
+  have_pending_gif_frame = false;
+  have_last_capture = false;
+  atomic_store(&queue_head, 0);
+  atomic_store(&queue_tail, 0);
+  atomic_store(&frames_dropped, 0);
+  atomic_store(&writer_running, true);
+
+  if (pthread_create(&writer_thread, NULL, recorder_writer_thread, NULL) != 0)
+  {
+    perror("Failed starting the recorder thread");
+    fclose(output);
+    return 1;
+  }
+
+  recording = true;
+  return 0;
+}
+
+/*
+Queues the screen for recording if it changed since the last capture. Never
+blocks: if the writer is behind, the frame is dropped.
+*/
+void recorder_capture(uint64_t frame)
+{
+  if (!recording)
+  {
+    return;
+  }
+
+  uint64_t rows[SCREEN_HEIGHT];
+  pack_screen(rows);
+
+  if (have_last_capture && memcmp(rows, last_capture, sizeof rows) == 0)
+  {
+    return;
+  }
+  memcpy(last_capture, rows, sizeof rows);
+  have_last_capture = true;
+
+  size_t head = atomic_load_explicit(&queue_head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&queue_tail, memory_order_acquire);
+
+  if (head - tail == RECORDER_QUEUE_SIZE)
+  {
+    atomic_fetch_add_explicit(&frames_dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  RecordedFrame *slot = &queue[head % RECORDER_QUEUE_SIZE];
+  slot->frame = frame;
+  memcpy(slot->rows, rows, sizeof rows);
+
+  atomic_store_explicit(&queue_head, head + 1, memory_order_release);
+}
+
+/*
+Waits for the writer to drain the queue and closes the file.
+*/
+void recorder_stop(void)
+{
+  if (!recording)
+  {
+    return;
+  }
+
+  recording = false;
+  atomic_store(&writer_running, false);
+  pthread_join(writer_thread, NULL);
+
+  uint64_t dropped = atomic_load(&frames_dropped);
+  if (dropped > 0)
+  {
+    fprintf(stderr, "Recorder dropped %llu frames.\n", (unsigned long long)dropped);
+  }
+}
+
+/*
+Playback of .c8r files.
+*/
+static FILE *playback = NULL;
+static uint8_t playback_frame_bytes[FRAME_BYTES];
+static uint64_t playback_frame_number = 0;
+
+/*
+Opens a .c8r recording for playback. Returns 0 on success.
+*/
+int recording_open(const char *filename)
+{
+  char magic[4];
+
+  playback = fopen(filename, "rb");
+  if (!playback)
+  {
+    perror("Recording not found.");
+    return 1;
+  }
+
+  if (fread(magic, 1, 4, playback) != 4 || memcmp(magic, "C8R1", 4) != 0)
+  {
+    fprintf(stderr, "%s is not a .c8r recording.\n", filename);
+    fclose(playback);
+    playback = NULL;
+    return 1;
+  }
+
+  memset(playback_frame_bytes, 0, sizeof playback_frame_bytes);
+  playback_frame_number = 0;
+  return 0;
+}
+
+/*
+Decodes the next recorded frame into rows, and the frame number it was
+captured at into frame. Returns false at the end of the recording.
+*/
+bool recording_next_frame(uint64_t rows[SCREEN_HEIGHT], uint64_t *frame)
+{
+  uint64_t frames_since = 0;
+  int shift = 0;
+  int byte;
+
+  if (playback == NULL)
+  {
+    return false;
+  }
+
+  do
+  {
+    byte = fgetc(playback);
+    if (byte == EOF || shift > 63)
+    {
+      return false;
+    }
+    frames_since |= (uint64_t)(byte & 0x7F) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+
+  int position = 0;
+  while (position < FRAME_BYTES)
+  {
+    int skip = fgetc(playback);
+    int count = fgetc(playback);
+
+    if (skip == EOF || count == EOF || skip + count == 0 || position + skip + count > FRAME_BYTES)
+    {
+      return false;
+    }
+
+    position += skip;
+    for (int i = 0; i < count; i++)
+    {
+      int delta = fgetc(playback);
+      if (delta == EOF)
+      {
+        return false;
+      }
+      playback_frame_bytes[position++] ^= delta;
+    }
+  }
+
+  playback_frame_number += frames_since;
+  bytes_to_rows(playback_frame_bytes, rows);
+  *frame = playback_frame_number;
+  return true;
+}
+
+void recording_close(void)
+{
+  if (playback != NULL)
+  {
+    fclose(playback);
+    playback = NULL;
+  }
+}
@@ -0,0 +1,246 @@
+#include "chip8.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RGBA_X86
+#endif
+
+/*
+Expands the packed 1-bit screen (see pack_screen) into 32-bit RGBA pixels at
+an integer scale. The window, screenshots, the GIF recorder and the shared
+memory export all go through here.
+
+Each screen row becomes one output line, built once, and the other lines of
+that row are memcpys of it. On x86 the line is built 4 pixels at a time with
+SSE2, or 8 with AVX2 when the CPU has it, picked at run time. Elsewhere it's
+built a pixel at a time.
+*/
+
+ScreenStyle screen_style = {
+    .on_color = RGBA_COLOR(245, 245, 245, 255),
+    .off_color = RGBA_COLOR(0, 0, 0, 255),
+    .grid = false,
+    .grid_color = RGBA_COLOR(40, 40, 40, 255),
+};
+
+/*
+Writes count copies of value to out.
+*/
+static void fill_words_scalar(uint32_t *out, uint32_t value, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    out[i] = value;
+  }
+}
+
+static void build_line_scalar(uint64_t row, int scale, const ScreenStyle *style, uint32_t *line)
+{
+  for (int x = 0; x < SCREEN_WIDTH; x++)
+  {
+    uint32_t color = (row >> (SCREEN_WIDTH - 1 - x)) & 1 ? style->on_color : style->off_color;
+    fill_words_scalar(line + x * scale, color, scale);
+  }
+}
+
+#ifdef RGBA_X86
+static void fill_words_sse2(uint32_t *out, uint32_t value, int count)
+{
+  __m128i values = _mm_set1_epi32(value);
+  int i = 0;
+
+  for (; i + 4 <= count; i += 4)
+  {
+    _mm_storeu_si128((__m128i *)(out + i), values);
+  }
+  for (; i < count; i++)
+  {
+    out[i] = value;
+  }
+}
+
+static void build_line_sse2(uint64_t row, int scale, const ScreenStyle *style, uint32_t *line)
+{
+  // Lane 0 is the leftmost pixel, which is the highest bit of the nibble
+  const __m128i bits = _mm_set_epi32(1, 2, 4, 8);
+  const __m128i on = _mm_set1_epi32(style->on_color);
+  const __m128i off = _mm_set1_epi32(style->off_color);
+
+  for (int x = 0; x < SCREEN_WIDTH; x += 4)
+  {
+    __m128i nibble = _mm_set1_epi32((row >> (SCREEN_WIDTH - 4 - x)) & 0xF);
+    __m128i lit = _mm_cmpeq_epi32(_mm_and_si128(nibble, bits), bits);
+    __m128i colors = _mm_or_si128(_mm_and_si128(lit, on), _mm_andnot_si128(lit, off));
+
+    if (scale == 1)
+    {
+      _mm_storeu_si128((__m128i *)(line + x), colors);
+    }
+    else if (scale == 2)
+    {
+      _mm_storeu_si128((__m128i *)(line + x * 2), _mm_unpacklo_epi32(colors, colors));
+      _mm_storeu_si128((__m128i *)(line + x * 2 + 4), _mm_unpackhi_epi32(colors, colors));
+    }
+    else
+    {
+      uint32_t lanes[4];
+      _mm_storeu_si128((__m128i *)lanes, colors);
+
+      for (int i = 0; i < 4; i++)
+      {
+        fill_words_sse2(line + (x + i) * scale, lanes[i], scale);
+      }
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void fill_words_avx2(uint32_t *out, uint32_t value, int count)
+{
+  __m256i values = _mm256_set1_epi32(value);
+  int i = 0;
+
+  for (; i + 8 <= count; i += 8)
+  {
+    _mm256_storeu_si256((__m256i *)(out + i), values);
+  }
+  if (i + 4 <= count)
+  {
+    _mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(values));
+    i += 4;
+  }
+  for (; i < count; i++)
+  {
+    out[i] = value;
+  }
+}
+
+__attribute__((target("avx2"))) static void build_line_avx2(uint64_t row, int scale, const ScreenStyle *style,
+                                                            uint32_t *line)
+{
+  const __m256i bits = _mm256_set_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256i on = _mm256_set1_epi32(style->on_color);
+  const __m256i off = _mm256_set1_epi32(style->off_color);
+
+  for (int x = 0; x < SCREEN_WIDTH; x += 8)
+  {
+    __m256i byte = _mm256_set1_epi32((row >> (SCREEN_WIDTH - 8 - x)) & 0xFF);
+    __m256i lit = _mm256_cmpeq_epi32(_mm256_and_si256(byte, bits), bits);
+    __m256i colors = _mm256_blendv_epi8(off, on, lit);
+
+    if (scale == 1)
+    {
+      _mm256_storeu_si256((__m256i *)(line + x), colors);
+    }
+    else if (scale == 2)
+    {
+      // The unpacks work within each 128 bit half, so put the halves back in order
+      __m256i low = _mm256_unpacklo_epi32(colors, colors);
+      __m256i high = _mm256_unpackhi_epi32(colors, colors);
+      _mm256_storeu_si256((__m256i *)(line + x * 2), _mm256_permute2x128_si256(low, high, 0x20));
+      _mm256_storeu_si256((__m256i *)(line + x * 2 + 8), _mm256_permute2x128_si256(low, high, 0x31));
+    }
+    else
+    {
+      uint32_t lanes[8];
+      _mm256_storeu_si256((__m256i *)lanes, colors);
+
+      for (int i = 0; i < 8; i++)
+      {
+        fill_words_avx2(line + (x + i) * scale, lanes[i], scale);
+      }
+    }
+  }
+}
+#endif
+
+/*
+Returns whether the given kernel can run on this machine.
+*/
+bool rgba_kernel_available(RgbaKernel kernel)
+{
+  switch (kernel)
+  {
+  case RGBA_KERNEL_AUTO:
+  case RGBA_KERNEL_SCALAR:
+    return true;
+#ifdef RGBA_X86
+  case RGBA_KERNEL_SSE2:
+    return __builtin_cpu_supports("sse2");
+  case RGBA_KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+/*
+expand_screen_rgba with a given kernel, for comparing them. The kernel must
+be available.
+*/
+void expand_screen_rgba_using(RgbaKernel kernel, const uint64_t rows[SCREEN_HEIGHT], int scale,
+                              const ScreenStyle *style, uint32_t *out)
+{
+  void (*build_line)(uint64_t, int, const ScreenStyle *, uint32_t *) = build_line_scalar;
+  void (*fill_words)(uint32_t *, uint32_t, int) = fill_words_scalar;
+
+  if (kernel == RGBA_KERNEL_AUTO)
+  {
+    kernel = rgba_kernel_available(RGBA_KERNEL_AVX2)   ? RGBA_KERNEL_AVX2
+             : rgba_kernel_available(RGBA_KERNEL_SSE2) ? RGBA_KERNEL_SSE2
+                                                       : RGBA_KERNEL_SCALAR;
+  }
+
+#ifdef RGBA_X86
+  if (kernel == RGBA_KERNEL_SSE2)
+  {
+    build_line = build_line_sse2;
+    fill_words = fill_words_sse2;
+  }
+  else if (kernel == RGBA_KERNEL_AVX2)
+  {
+    build_line = build_line_avx2;
+    fill_words = fill_words_avx2;
+  }
+#endif
+
+  int width = SCREEN_WIDTH * scale;
+  // A grid on unscaled pixels would hide them all
+  bool grid = style->grid && scale > 1;
+  int lit_lines = grid ? scale - 1 : scale;
+
+  for (int y = 0; y < SCREEN_HEIGHT; y++)
+  {
+    uint32_t *line = out + (size_t)y * scale * width;
+
+    build_line(rows[y], scale, style, line);
+
+    if (grid)
+    {
+      for (int x = scale - 1; x < width; x += scale)
+      {
+        line[x] = style->grid_color;
+      }
+    }
+
+    for (int i = 1; i < lit_lines; i++)
+    {
+      memcpy(line + (size_t)i * width, line, width * sizeof line[0]);
+    }
+
+    if (grid)
+    {
+      fill_words(line + (size_t)(scale - 1) * width, style->grid_color, width);
+    }
+  }
+}
+
+/*
+Writes the screen to out as (SCREEN_WIDTH * scale) x (SCREEN_HEIGHT * scale)
+pixels, row by row, with the fastest kernel this machine has.
+*/
+void expand_screen_rgba(const uint64_t rows[SCREEN_HEIGHT], int scale, const ScreenStyle *style, uint32_t *out)
+{
+  expand_screen_rgba_using(RGBA_KERNEL_AUTO, rows, scale, style, out);
+}
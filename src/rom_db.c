@@ -0,0 +1,365 @@
+#include "chip8.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+The ROM database: a text file with one line per ROM, read once at startup
+into an open addressing hash table keyed by rom_hash. Looking a ROM up is a
+hash of its bytes and a probe or two.
+
+A line is the ROM's hash (what `chip8 --rom-hash <rom>` prints) followed by
+any of these, in any order. Anything after a # is a comment.
+
+  platform=chip8|vip   vip is the VIP's timing and quirks, like --vip
+  quirks=<list>|none   replaces the platform's quirks: shift, memory, jump,
+                       vfreset, clip
+  cycles=<n>           instructions per 60 Hz frame
+  keys=<16 keys>       the keyboard key for Chip-8 keys 0 to F, e.g.
+                       X123QWEASDZC4RFV
+  colors=<on>,<off>    like --colors
+
+A bad line is reported and skipped, so one typo doesn't lose the rest.
+*/
+
+#define ROM_DB_LINE_SIZE 512
+// Keep the table at most half full so probes stay short
+#define ROM_DB_MIN_SLOTS_PER_ENTRY 2
+
+static RomDbEntry *entries = NULL;
+static int entry_count = 0;
+// Each slot is an index into entries plus one, or 0 when empty
+static int *slots = NULL;
+static size_t slot_mask = 0;
+
+/*
+FNV-1a over the ROM's bytes.
+*/
+uint64_t rom_hash(const BYTE *rom, size_t size)
+{
+  uint64_t hash = 0xCBF29CE484222325ull;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    hash = (hash ^ rom[i]) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+static int parse_quirks(const char *list, Quirks *out)
+{
+  char copy[ROM_DB_LINE_SIZE];
+
+  memset(out, 0, sizeof *out);
+  if (strcmp(list, "none") == 0)
+  {
+    return 0;
+  }
+
+  snprintf(copy, sizeof copy, "%s", list);
+  for (char *name = strtok(copy, ","); name != NULL; name = strtok(NULL, ","))
+  {
+    if (strcmp(name, "shift") == 0)
+    {
+      out->shift_uses_vy = true;
+    }
+    else if (strcmp(name, "memory") == 0)
+    {
+      out->load_store_increments_i = true;
+    }
+    else if (strcmp(name, "jump") == 0)
+    {
+      out->jump_uses_vx = true;
+    }
+    else if (strcmp(name, "vfreset") == 0)
+    {
+      out->logic_resets_vf = true;
+    }
+    else if (strcmp(name, "clip") == 0)
+    {
+      out->sprites_clip = true;
+    }
+    else
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int parse_color(const char *text, uint32_t *color)
+{
+  char *end;
+  unsigned long rgb = strtoul(text, &end, 16);
+
+  if (end - text != 6)
+  {
+    return 1;
+  }
+
+  *color = RGBA_COLOR(rgb >> 16, (rgb >> 8) & 0xFF, rgb & 0xFF, 0xFF);
+  return 0;
+}
+
+/*
+Fills entry from the key=value fields of one line. Returns 0 on success.
+*/
+static int parse_field(char *field, RomDbEntry *entry)
+{
+  char *value = strchr(field, '=');
+
+  if (value == NULL)
+  {
+    return 1;
+  }
+  *value++ = '\0';
+
+  if (strcmp(field, "platform") == 0)
+  {
+    if (strcmp(value, "chip8") != 0 && strcmp(value, "vip") != 0)
+    {
+      return 1;
+    }
+    entry->vip_timing = strcmp(value, "vip") == 0;
+    entry->fields |= ROM_DB_PLATFORM;
+    // An explicit quirks= wins whichever side of this it's on
+    if (!(entry->fields & ROM_DB_QUIRKS))
+    {
+      memset(&entry->quirks, 0, sizeof entry->quirks);
+      if (entry->vip_timing)
+      {
+        entry->quirks = vip_quirks;
+      }
+    }
+    return 0;
+  }
+
+  if (strcmp(field, "quirks") == 0)
+  {
+    entry->fields |= ROM_DB_QUIRKS;
+    return parse_quirks(value, &entry->quirks);
+  }
+
+  if (strcmp(field, "cycles") == 0)
+  {
+    char *end;
+    long cycles = strtol(value, &end, 10);
+
+    if (*end != '\0' || cycles < 1 || cycles > 100000)
+    {
+      return 1;
+    }
+    entry->cycles_per_frame = cycles;
+    entry->fields |= ROM_DB_CYCLES;
+    return 0;
+  }
+
+  if (strcmp(field, "keys") == 0)
+  {
+    if (strlen(value) != 16)
+    {
+      return 1;
+    }
+    for (int i = 0; i < 16; i++)
+    {
+      if (!isalnum((unsigned char)value[i]))
+      {
+        return 1;
+      }
+      entry->keys[i] = toupper((unsigned char)value[i]);
+    }
+    entry->fields |= ROM_DB_KEYS;
+    return 0;
+  }
+
+  if (strcmp(field, "colors") == 0)
+  {
+    char *comma = strchr(value, ',');
+
+    if (comma == NULL)
+    {
+      return 1;
+    }
+    *comma = '\0';
+    entry->fields |= ROM_DB_COLORS;
+    return parse_color(value, &entry->on_color) != 0 || parse_color(comma + 1, &entry->off_color) != 0;
+  }
+
+  return 1;
+}
+
+/*
+Parses one line into entry. Returns 1 if the line is blank or a comment, -1
+if it's bad, and 0 if entry now holds a ROM.
+*/
+static int parse_line(char *line, RomDbEntry *entry)
+{
+  char *comment = strchr(line, '#');
+  if (comment != NULL)
+  {
+    *comment = '\0';
+  }
+
+  char *hash = strtok(line, " \t\r\n");
+  if (hash == NULL)
+  {
+    return 1;
+  }
+
+  char *end;
+  memset(entry, 0, sizeof *entry);
+  entry->hash = strtoull(hash, &end, 16);
+  if (end - hash != 16 || *end != '\0')
+  {
+    return -1;
+  }
+
+  // Gather the fields before parsing any, since parse_quirks uses strtok too
+  char *fields[16];
+  int field_count = 0;
+  for (char *field = strtok(NULL, " \t\r\n"); field != NULL; field = strtok(NULL, " \t\r\n"))
+  {
+    if (field_count == (int)(sizeof fields / sizeof fields[0]))
+    {
+      return -1;
+    }
+    fields[field_count++] = field;
+  }
+
+  for (int i = 0; i < field_count; i++)
+  {
+    if (parse_field(fields[i], entry) != 0)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+Builds the hash table over entries. Returns 0 on success.
+*/
+static int build_index(void)
+{
+  size_t slot_count = 16;
+
+  while (slot_count < (size_t)entry_count * ROM_DB_MIN_SLOTS_PER_ENTRY)
+  {
+    slot_count *= 2;
+  }
+
+  slots = calloc(slot_count, sizeof slots[0]);
+  if (slots == NULL)
+  {
+    return 1;
+  }
+  slot_mask = slot_count - 1;
+
+  for (int i = 0; i < entry_count; i++)
+  {
+    size_t slot = entries[i].hash & slot_mask;
+
+    // A ROM listed twice gets its last line
+    while (slots[slot] != 0 && entries[slots[slot] - 1].hash != entries[i].hash)
+    {
+      slot = (slot + 1) & slot_mask;
+    }
+    slots[slot] = i + 1;
+  }
+  return 0;
+}
+
+/*
+Reads the database at path, replacing any loaded before. Returns 0 on
+success, and 1 if the file can't be read.
+*/
+int rom_db_load(const char *path)
+{
+  FILE *file = fopen(path, "r");
+
+  if (file == NULL)
+  {
+    return 1;
+  }
+
+  rom_db_free();
+
+  char line[ROM_DB_LINE_SIZE];
+  int capacity = 0;
+  int line_number = 0;
+
+  while (fgets(line, sizeof line, file) != NULL)
+  {
+    RomDbEntry entry;
+    line_number++;
+
+    int result = parse_line(line, &entry);
+    if (result < 0)
+    {
+      fprintf(stderr, "%s:%d: bad ROM database line, skipping it\n", path, line_number);
+      continue;
+    }
+    if (result > 0)
+    {
+      continue;
+    }
+
+    if (entry_count == capacity)
+    {
+      int new_capacity = capacity == 0 ? 64 : capacity * 2;
+      RomDbEntry *grown = realloc(entries, new_capacity * sizeof entries[0]);
+
+      if (grown == NULL)
+      {
+        perror("Failed reading the ROM database");
+        fclose(file);
+        rom_db_free();
+        return 1;
+      }
+      entries = grown;
+      capacity = new_capacity;
+    }
+    entries[entry_count++] = entry;
+  }
+
+  fclose(file);
+
+  if (build_index() != 0)
+  {
+    perror("Failed reading the ROM database");
+    rom_db_free();
+    return 1;
+  }
+  return 0;
+}
+
+/*
+Returns the entry for the ROM with the given hash, or NULL if there's none.
+*/
+const RomDbEntry *rom_db_find(uint64_t hash)
+{
+  if (slots == NULL)
+  {
+    return NULL;
+  }
+
+  for (size_t slot = hash & slot_mask; slots[slot] != 0; slot = (slot + 1) & slot_mask)
+  {
+    if (entries[slots[slot] - 1].hash == hash)
+    {
+      return &entries[slots[slot] - 1];
+    }
+  }
+  return NULL;
+}
+
+void rom_db_free(void)
+{
+  free(entries);
+  free(slots);
+  entries = NULL;
+  slots = NULL;
+  entry_count = 0;
+  slot_mask = 0;
+}
@@ -0,0 +1,159 @@
+#include "chip8.h"
+#include <libgen.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/inotify.h>
+#endif
+
+/*
+Watches the ROM file for changes, for --hot-reload. The window polls
+rom_watch_changed once per frame, so nothing here blocks or runs on its own
+thread.
+
+On Linux it's inotify on the ROM's directory rather than on the file itself:
+editors and build tools often write a new file and rename it over the old
+one, which a watch on the old file would never see. Elsewhere, or if inotify
+isn't available, it falls back to comparing the file's stat a few times a
+second.
+*/
+
+// How often the stat fallback looks at the file
+#define ROM_WATCH_POLL_SECONDS 0.25
+
+static char watched_path[4096];
+static char watched_name[256];
+static int inotify_fd = -1;
+static struct stat last_stat;
+static bool last_stat_valid = false;
+static double next_poll_time = 0;
+
+static double monotonic_seconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+Whether the file looks different from when it was last looked at, by stat.
+*/
+static bool stat_changed(void)
+{
+  struct stat now;
+
+  if (stat(watched_path, &now) != 0)
+  {
+    // Gone for now, most likely in the middle of being replaced
+    last_stat_valid = false;
+    return false;
+  }
+
+  bool changed = !last_stat_valid || now.st_ino != last_stat.st_ino || now.st_size != last_stat.st_size ||
+                 now.st_mtime != last_stat.st_mtime;
+
+  last_stat = now;
+  last_stat_valid = true;
+  return changed;
+}
+
+/*
+Starts watching the file at path. Returns 0 on success.
+*/
+int rom_watch_start(const char *path)
+{
+  char directory[sizeof watched_path];
+  char name[sizeof watched_path];
+
+  if (strlen(path) >= sizeof watched_path)
+  {
+    fprintf(stderr, "ROM path too long to watch.\n");
+    return 1;
+  }
+
+  // dirname and basename may modify their argument
+  snprintf(watched_path, sizeof watched_path, "%s", path);
+  snprintf(directory, sizeof directory, "%s", path);
+  snprintf(name, sizeof name, "%s", path);
+  snprintf(watched_name, sizeof watched_name, "%s", basename(name));
+
+  stat_changed();
+
+#ifdef __linux__
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, dirname(directory), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+  {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+#endif
+
+  if (inotify_fd < 0)
+  {
+    fprintf(stderr, "inotify not available, checking %s for changes every %.2f s\n", path, ROM_WATCH_POLL_SECONDS);
+  }
+  return 0;
+}
+
+/*
+Returns true once for every time the file was finished being written or
+replaced since the last call.
+*/
+bool rom_watch_changed(void)
+{
+#ifdef __linux__
+  if (inotify_fd >= 0)
+  {
+    bool changed = false;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    while ((length = read(inotify_fd, events, sizeof events)) > 0)
+    {
+      for (char *at = events; at < events + length;)
+      {
+        const struct inotify_event *event = (const struct inotify_event *)at;
+
+        if (event->len > 0 && strcmp(event->name, watched_name) == 0)
+        {
+          changed = true;
+        }
+        at += sizeof *event + event->len;
+      }
+    }
+
+    // Keep the stat current, so a later fallback doesn't see this change again
+    if (changed)
+    {
+      stat_changed();
+    }
+    return changed;
+  }
+#endif
+
+  double now = monotonic_seconds();
+  if (now < next_poll_time)
+  {
+    return false;
+  }
+  next_poll_time = now + ROM_WATCH_POLL_SECONDS;
+
+  return stat_changed();
+}
+
+void rom_watch_stop(void)
+{
+#ifdef __linux__
+  if (inotify_fd >= 0)
+  {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+#endif
+}
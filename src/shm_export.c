@@ -0,0 +1,131 @@
+#include "chip8.h"
+#include "shm_export.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+Publishes the screen and registers to a POSIX shared memory segment once per
+frame, and reads back the keys held by whoever is on the other side. See
+shm_export.h for the layout and how to read it.
+*/
+
+static Chip8SharedState *shared_state = NULL;
+static size_t shared_size = 0;
+static int rgba_scale = 1;
+static char shared_name[64];
+// Keys from input_mask, as read at the start of the frame
+static uint32_t frame_input_mask = 0;
+
+/*
+Creates (or reuses) the segment with the given name, e.g. "/chip8-0", with
+the RGBA screen at the given scale. Returns 0 on success.
+*/
+int shm_export_open(const char *name, int scale)
+{
+  rgba_scale = scale;
+  shared_size = sizeof(Chip8SharedState) + (size_t)SCREEN_WIDTH * SCREEN_HEIGHT * scale * scale * sizeof(uint32_t);
+
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+
+  if (fd < 0)
+  {
+    perror("Failed opening the shared memory segment");
+    return 1;
+  }
+
+  if (ftruncate(fd, shared_size) != 0)
+  {
+    perror("Failed sizing the shared memory segment");
+    close(fd);
+    return 1;
+  }
+
+  shared_state = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (shared_state == MAP_FAILED)
+  {
+    perror("Failed mapping the shared memory segment");
+    shared_state = NULL;
+    return 1;
+  }
+
+  memset(shared_state, 0, shared_size);
+  shared_state->magic = CHIP8_SHM_MAGIC;
+  shared_state->version = CHIP8_SHM_VERSION;
+  shared_state->rgba_width = SCREEN_WIDTH * scale;
+  shared_state->rgba_height = SCREEN_HEIGHT * scale;
+  snprintf(shared_name, sizeof shared_name, "%s", name);
+
+  return 0;
+}
+
+/*
+Unmaps and removes the segment.
+*/
+void shm_export_close(void)
+{
+  if (shared_state == NULL)
+  {
+    return;
+  }
+
+  munmap(shared_state, shared_size);
+  shm_unlink(shared_name);
+  shared_state = NULL;
+}
+
+/*
+Writes the current frame and registers to the segment.
+*/
+void shm_export_publish(void)
+{
+  if (shared_state == NULL)
+  {
+    return;
+  }
+
+  uint32_t sequence = atomic_load_explicit(&shared_state->sequence, memory_order_relaxed);
+
+  // Odd: readers back off until we're done
+  atomic_store_explicit(&shared_state->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  pack_screen(shared_state->pixels);
+  expand_screen_rgba(shared_state->pixels, rgba_scale, &screen_style, shared_state->rgba);
+  memcpy(shared_state->registers, registers, sizeof shared_state->registers);
+  memcpy(shared_state->stack, stack, sizeof shared_state->stack);
+  shared_state->I = I;
+  shared_state->pc = pc;
+  shared_state->stack_pointer = stack_pointer;
+  shared_state->delay_timer = delay_timer;
+  shared_state->sound_timer = sound_timer;
+  shared_state->cycle_count = cycle_count;
+  shared_state->frame++;
+
+  atomic_store_explicit(&shared_state->sequence, sequence + 2, memory_order_release);
+}
+
+/*
+Takes a snapshot of the keys held by the external process. Called once per
+frame, so a key can't appear halfway through a frame's cycles.
+*/
+void shm_export_read_input(void)
+{
+  if (shared_state != NULL)
+  {
+    frame_input_mask = atomic_load_explicit(&shared_state->input_mask, memory_order_relaxed);
+  }
+}
+
+/*
+Returns the keys held by the external process, as of the last
+shm_export_read_input. 0 without a segment.
+*/
+uint16_t shm_export_keypad(void)
+{
+  return frame_input_mask & 0xFFFF;
+}
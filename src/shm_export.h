@@ -0,0 +1,61 @@
+#ifndef SHM_EXPORT_H
+#define SHM_EXPORT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+Layout of the POSIX shared memory segment published with --shm <name>.
+External processes shm_open the same name read-write and mmap
+sizeof(Chip8SharedState) + rgba_width * rgba_height * 4 bytes, or just the
+size of the segment (fstat).
+
+Everything but input_mask is written by the emulator once per frame under a
+seqlock. To read a consistent copy:
+
+  for (;;) {
+    uint32_t start = atomic_load_explicit(&state->sequence, memory_order_acquire);
+    if (start & 1) continue;                // a write is in progress
+    ...copy the fields you need...
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&state->sequence, memory_order_relaxed) == start) break;
+  }
+
+tests/shm_reader.c reads the segment exactly this way.
+
+rgba is the screen as rgba_width x rgba_height RGBA pixels (bytes in R, G,
+B, A order), scaled by --shm-scale and in the colors given with --colors.
+
+input_mask is written by the external process: bit n set means Chip-8 key n
+is held down. The emulator reads it once per frame.
+*/
+
+#define CHIP8_SHM_MAGIC 0x38504843 // "CHP8"
+#define CHIP8_SHM_VERSION 2
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  // Odd while the emulator is writing
+  _Atomic uint32_t sequence;
+  _Atomic uint32_t input_mask;
+  // Number of frames published so far
+  uint64_t frame;
+  uint64_t cycle_count;
+  // One row per entry, the leftmost pixel in the most significant bit
+  uint64_t pixels[32];
+  uint8_t registers[16];
+  uint16_t stack[16];
+  uint16_t I;
+  uint16_t pc;
+  uint8_t stack_pointer;
+  uint8_t delay_timer;
+  uint8_t sound_timer;
+  uint8_t reserved;
+  uint32_t rgba_width;
+  uint32_t rgba_height;
+  uint32_t rgba[];
+} Chip8SharedState;
+
+#endif
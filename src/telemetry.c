@@ -0,0 +1,459 @@
+#include "chip8.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+Runtime counters, for telling when an instance falls behind real time.
+
+The emulation and window threads record into them with relaxed atomics and
+never take a lock, so the cost is a handful of atomic adds per frame. The
+metrics server and the stats line read them from their own threads.
+
+Presented frames are the window's, and say how smooth it looked. Emulated
+frames are the 60 Hz frames of emulated time, in the window and headless
+alike, and say whether emulation kept up: a late one finished after the next
+was due, and a dropped one was never run because emulation fell too far
+behind to catch up.
+*/
+
+// A frame is late if it took this many times the 60 Hz frame time or more
+#define LATE_FRAME_FACTOR 1.5
+#define METRICS_RESPONSE_SIZE 4096
+#define METRICS_CLIENT_TIMEOUT_SECONDS 2
+
+// Upper bounds in seconds of the frame time histogram buckets, plus +Inf
+static const double frame_time_buckets[] = {0.004, 0.008, 0.012, 0.017, 0.020, 0.025,
+                                            0.033, 0.050, 0.100, 0.250};
+#define FRAME_TIME_BUCKET_COUNT (sizeof frame_time_buckets / sizeof frame_time_buckets[0])
+
+// Input-to-present latencies are counted in 1 ms buckets up to this, plus one
+// for everything slower, so percentiles come out to the millisecond
+#define INPUT_LATENCY_MAX_MS 250
+// Bounds of the input latency histogram as exported, plus +Inf
+static const double input_latency_buckets[] = {0.008, 0.016, 0.025, 0.033, 0.050, 0.067, 0.100, 0.250};
+#define INPUT_LATENCY_BUCKET_COUNT (sizeof input_latency_buckets / sizeof input_latency_buckets[0])
+
+static atomic_uint_fast64_t instructions_retired;
+static atomic_uint_fast64_t frames_presented;
+static atomic_uint_fast64_t frames_late;
+static atomic_uint_fast64_t emulated_frames;
+static atomic_uint_fast64_t emulated_frames_late;
+static atomic_uint_fast64_t emulated_frames_dropped;
+static atomic_uint_fast64_t max_catchup_cycles;
+// The last bucket counts frames slower than every bound
+static atomic_uint_fast64_t frame_time_counts[FRAME_TIME_BUCKET_COUNT + 1];
+static atomic_uint_fast64_t frame_time_sum_us;
+static atomic_uint_fast64_t input_latency_counts[INPUT_LATENCY_MAX_MS + 1];
+static atomic_uint_fast64_t input_latency_sum_us;
+
+static int metrics_socket = -1;
+static double stats_interval = 0;
+
+/*
+Counts instructions retired outside of frames, e.g. by a headless run.
+*/
+void telemetry_record_instructions(uint64_t count)
+{
+  atomic_fetch_add_explicit(&instructions_retired, count, memory_order_relaxed);
+}
+
+/*
+Records cycles the emulation ran back to back, without sleeping in between.
+Normally that's one frame's worth. More means it was catching up.
+*/
+void telemetry_record_burst(uint64_t cycles)
+{
+  atomic_fetch_add_explicit(&instructions_retired, cycles, memory_order_relaxed);
+
+  uint64_t max = atomic_load_explicit(&max_catchup_cycles, memory_order_relaxed);
+  while (cycles > max &&
+         !atomic_compare_exchange_weak_explicit(&max_catchup_cycles, &max, cycles,
+                                                memory_order_relaxed, memory_order_relaxed))
+  {
+  }
+}
+
+/*
+Records one presented frame and how long it took on the host.
+*/
+void telemetry_record_frame(double frame_seconds)
+{
+  atomic_fetch_add_explicit(&frames_presented, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&frame_time_sum_us, (uint64_t)(frame_seconds * 1e6), memory_order_relaxed);
+
+  if (frame_seconds >= LATE_FRAME_FACTOR / TIMER_HZ)
+  {
+    atomic_fetch_add_explicit(&frames_late, 1, memory_order_relaxed);
+  }
+
+  size_t bucket = 0;
+  while (bucket < FRAME_TIME_BUCKET_COUNT && frame_seconds > frame_time_buckets[bucket])
+  {
+    bucket++;
+  }
+  atomic_fetch_add_explicit(&frame_time_counts[bucket], 1, memory_order_relaxed);
+}
+
+/*
+Records emulated frames run, late of which finished after the next one was
+due.
+*/
+void telemetry_record_emulated_frames(uint64_t frames, uint64_t late)
+{
+  atomic_fetch_add_explicit(&emulated_frames, frames, memory_order_relaxed);
+  atomic_fetch_add_explicit(&emulated_frames_late, late, memory_order_relaxed);
+}
+
+/*
+Records emulated frames skipped because emulation fell too far behind.
+*/
+void telemetry_record_frames_dropped(uint64_t frames)
+{
+  atomic_fetch_add_explicit(&emulated_frames_dropped, frames, memory_order_relaxed);
+}
+
+/*
+Records the time from a key press to the first presented frame it changed.
+*/
+void telemetry_record_input_latency(double seconds)
+{
+  int bucket = (int)(seconds * 1000);
+
+  if (bucket < 0)
+  {
+    bucket = 0;
+  }
+  if (bucket > INPUT_LATENCY_MAX_MS)
+  {
+    bucket = INPUT_LATENCY_MAX_MS;
+  }
+
+  atomic_fetch_add_explicit(&input_latency_counts[bucket], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&input_latency_sum_us, (uint64_t)(seconds * 1e6), memory_order_relaxed);
+}
+
+/*
+Returns the number of input latencies recorded.
+*/
+static uint64_t input_latency_count(void)
+{
+  uint64_t count = 0;
+
+  for (int i = 0; i <= INPUT_LATENCY_MAX_MS; i++)
+  {
+    count += atomic_load_explicit(&input_latency_counts[i], memory_order_relaxed);
+  }
+
+  return count;
+}
+
+/*
+Returns the given percentile (0-100) of the input latencies recorded, in
+whole milliseconds rounded up. count is what input_latency_count returned.
+*/
+static int input_latency_percentile(double percentile, uint64_t count)
+{
+  uint64_t wanted = (uint64_t)(count * percentile / 100 + 0.5);
+  uint64_t seen = 0;
+
+  for (int i = 0; i <= INPUT_LATENCY_MAX_MS; i++)
+  {
+    seen += atomic_load_explicit(&input_latency_counts[i], memory_order_relaxed);
+    if (seen >= wanted && seen > 0)
+    {
+      return i + 1;
+    }
+  }
+
+  return INPUT_LATENCY_MAX_MS + 1;
+}
+
+/*
+Prints the input latency percentiles to stderr, if any key presses were
+measured.
+*/
+void telemetry_print_input_latency(void)
+{
+  uint64_t count = input_latency_count();
+
+  if (count == 0)
+  {
+    return;
+  }
+
+  fprintf(stderr, "chip8: input-to-present latency over %llu key presses: p50 %d ms, p90 %d ms, p99 %d ms, mean %.1f ms\n",
+          (unsigned long long)count, input_latency_percentile(50, count), input_latency_percentile(90, count),
+          input_latency_percentile(99, count), atomic_load(&input_latency_sum_us) / 1e3 / count);
+}
+
+/*
+Writes all counters into out in the Prometheus text format. Returns the
+number of characters written.
+*/
+static int format_metrics(char *out, size_t size)
+{
+  int used = snprintf(out, size,
+                      "# TYPE chip8_instructions_retired_total counter\n"
+                      "chip8_instructions_retired_total %llu\n"
+                      "# TYPE chip8_frames_presented_total counter\n"
+                      "chip8_frames_presented_total %llu\n"
+                      "# TYPE chip8_frames_late_total counter\n"
+                      "chip8_frames_late_total %llu\n"
+                      "# TYPE chip8_emulated_frames_total counter\n"
+                      "chip8_emulated_frames_total %llu\n"
+                      "# TYPE chip8_emulated_frames_late_total counter\n"
+                      "chip8_emulated_frames_late_total %llu\n"
+                      "# TYPE chip8_emulated_frames_dropped_total counter\n"
+                      "chip8_emulated_frames_dropped_total %llu\n"
+                      "# TYPE chip8_max_catchup_cycles gauge\n"
+                      "chip8_max_catchup_cycles %llu\n"
+                      "# TYPE chip8_frame_seconds histogram\n",
+                      (unsigned long long)atomic_load(&instructions_retired),
+                      (unsigned long long)atomic_load(&frames_presented),
+                      (unsigned long long)atomic_load(&frames_late),
+                      (unsigned long long)atomic_load(&emulated_frames),
+                      (unsigned long long)atomic_load(&emulated_frames_late),
+                      (unsigned long long)atomic_load(&emulated_frames_dropped),
+                      (unsigned long long)atomic_load(&max_catchup_cycles));
+
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i <= FRAME_TIME_BUCKET_COUNT && used < (int)size; i++)
+  {
+    cumulative += atomic_load(&frame_time_counts[i]);
+
+    if (i < FRAME_TIME_BUCKET_COUNT)
+    {
+      used += snprintf(out + used, size - used, "chip8_frame_seconds_bucket{le=\"%g\"} %llu\n",
+                       frame_time_buckets[i], (unsigned long long)cumulative);
+    }
+    else
+    {
+      used += snprintf(out + used, size - used, "chip8_frame_seconds_bucket{le=\"+Inf\"} %llu\n",
+                       (unsigned long long)cumulative);
+    }
+  }
+
+  if (used < (int)size)
+  {
+    used += snprintf(out + used, size - used,
+                     "chip8_frame_seconds_sum %f\n"
+                     "chip8_frame_seconds_count %llu\n"
+                     "# TYPE chip8_input_latency_seconds histogram\n",
+                     atomic_load(&frame_time_sum_us) / 1e6, (unsigned long long)cumulative);
+  }
+
+  // Sums of the 1 ms buckets, up to each exported bound
+  cumulative = 0;
+  int millisecond = 0;
+  for (size_t i = 0; i < INPUT_LATENCY_BUCKET_COUNT && used < (int)size; i++)
+  {
+    for (; millisecond < input_latency_buckets[i] * 1000 - 0.5; millisecond++)
+    {
+      cumulative += atomic_load(&input_latency_counts[millisecond]);
+    }
+
+    used += snprintf(out + used, size - used, "chip8_input_latency_seconds_bucket{le=\"%g\"} %llu\n",
+                     input_latency_buckets[i], (unsigned long long)cumulative);
+  }
+
+  if (used < (int)size)
+  {
+    uint64_t count = input_latency_count();
+    used += snprintf(out + used, size - used,
+                     "chip8_input_latency_seconds_bucket{le=\"+Inf\"} %llu\n"
+                     "chip8_input_latency_seconds_sum %f\n"
+                     "chip8_input_latency_seconds_count %llu\n",
+                     (unsigned long long)count, atomic_load(&input_latency_sum_us) / 1e6,
+                     (unsigned long long)count);
+  }
+
+  return used < (int)size ? used : (int)size - 1;
+}
+
+/*
+Serves one client at a time. A client that connects and then sends nothing,
+or stops reading, is dropped after METRICS_CLIENT_TIMEOUT_SECONDS so it
+can't hold up everyone scraping after it.
+*/
+static void *metrics_server_thread(void *arg)
+{
+  (void)arg;
+  char request[1024];
+  char body[METRICS_RESPONSE_SIZE];
+  char header[128];
+  struct timeval timeout = {METRICS_CLIENT_TIMEOUT_SECONDS, 0};
+
+  while (true)
+  {
+    int client = accept(metrics_socket, NULL, NULL);
+
+    if (client < 0)
+    {
+      continue;
+    }
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+    ssize_t length = recv(client, request, sizeof request - 1, 0);
+
+    if (length <= 0)
+    {
+      // Timed out or hung up without asking for anything
+      close(client);
+      continue;
+    }
+    request[length] = '\0';
+
+    // Anything but GET /metrics gets a 404
+
+    if (strncmp(request, "GET /metrics", 12) == 0)
+    {
+      int body_length = format_metrics(body, sizeof body);
+      int header_length = snprintf(header, sizeof header,
+                                   "HTTP/1.0 200 OK\r\n"
+                                   "Content-Type: text/plain; version=0.0.4\r\n"
+                                   "Content-Length: %d\r\n\r\n",
+                                   body_length);
+      send(client, header, header_length, 0);
+      send(client, body, body_length, 0);
+    }
+    else
+    {
+      const char *not_found = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+      send(client, not_found, strlen(not_found), 0);
+    }
+
+    close(client);
+  }
+
+  return NULL;
+}
+
+/*
+Prints a stats line to stderr every stats_interval seconds, with rates over
+that interval.
+*/
+static void *stats_line_thread(void *arg)
+{
+  (void)arg;
+  uint64_t last_instructions = 0;
+  uint64_t last_frames = 0;
+  uint64_t last_late = 0;
+  uint64_t last_emulated = 0;
+  uint64_t last_emulated_late = 0;
+  uint64_t last_dropped = 0;
+  struct timespec interval = {
+      .tv_sec = (time_t)stats_interval,
+      .tv_nsec = (long)((stats_interval - (time_t)stats_interval) * 1e9),
+  };
+
+  while (true)
+  {
+    nanosleep(&interval, NULL);
+
+    uint64_t instructions = atomic_load(&instructions_retired);
+    uint64_t frames = atomic_load(&frames_presented);
+    uint64_t late = atomic_load(&frames_late);
+    uint64_t emulated = atomic_load(&emulated_frames);
+    uint64_t emulated_late = atomic_load(&emulated_frames_late);
+    uint64_t dropped = atomic_load(&emulated_frames_dropped);
+
+    uint64_t presses = input_latency_count();
+    char latency[64] = "";
+
+    if (presses > 0)
+    {
+      snprintf(latency, sizeof latency, ", input latency p50 %d ms p99 %d ms",
+               input_latency_percentile(50, presses), input_latency_percentile(99, presses));
+    }
+
+    fprintf(stderr,
+            "chip8: %.0f Hz, %.1f fps, %llu late frames, %.1f emulated fps, %llu emulated late, %llu dropped, "
+            "max catch-up %llu cycles%s\n",
+            (instructions - last_instructions) / stats_interval,
+            (frames - last_frames) / stats_interval,
+            (unsigned long long)(late - last_late),
+            (emulated - last_emulated) / stats_interval,
+            (unsigned long long)(emulated_late - last_emulated_late),
+            (unsigned long long)(dropped - last_dropped),
+            (unsigned long long)atomic_load(&max_catchup_cycles), latency);
+
+    last_instructions = instructions;
+    last_frames = frames;
+    last_late = late;
+    last_emulated = emulated;
+    last_emulated_late = emulated_late;
+    last_dropped = dropped;
+  }
+
+  return NULL;
+}
+
+/*
+Starts serving GET /metrics on 127.0.0.1 at the given port. Returns 0 on
+success.
+*/
+int telemetry_start_server(int port)
+{
+  struct sockaddr_in address = {0};
+  int reuse = 1;
+
+  metrics_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (metrics_socket < 0)
+  {
+    perror("Failed creating the metrics socket");
+    return 1;
+  }
+
+  setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+
+  if (bind(metrics_socket, (struct sockaddr *)&address, sizeof address) != 0 ||
+      listen(metrics_socket, 4) != 0)
+  {
+    perror("Failed listening for metrics requests");
+    close(metrics_socket);
+    return 1;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, metrics_server_thread, NULL) != 0)
+  {
+    perror("Failed starting the metrics thread");
+    close(metrics_socket);
+    return 1;
+  }
+  pthread_detach(thread);
+
+  return 0;
+}
+
+/*
+Starts printing a stats line to stderr every interval seconds. Returns 0 on
+success.
+*/
+int telemetry_start_stats_line(double interval)
+{
+  stats_interval = interval;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, stats_line_thread, NULL) != 0)
+  {
+    perror("Failed starting the stats thread");
+    return 1;
+  }
+  pthread_detach(thread);
+
+  return 0;
+}
@@ -0,0 +1,188 @@
+#include "chip8.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+Checks every RGBA kernel in rgba.c against a plain pixel by pixel expansion,
+then times them. `make test` runs it with --check, which skips the timing.
+*/
+
+#define BENCH_SECONDS 0.2
+#define BENCH_MAX_SCALE 16
+
+static const int bench_scales[] = {1, 2, 4, 10, 16};
+static const char *kernel_names[] = {"auto", "scalar", "sse2", "avx2"};
+
+static double seconds_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+The screen the simple way: work out the color of every output pixel on its
+own.
+*/
+static void expand_per_pixel(const uint64_t rows[SCREEN_HEIGHT], int scale, const ScreenStyle *style,
+                             uint32_t *out)
+{
+  int width = SCREEN_WIDTH * scale;
+  bool grid = style->grid && scale > 1;
+
+  for (int y = 0; y < SCREEN_HEIGHT * scale; y++)
+  {
+    for (int x = 0; x < width; x++)
+    {
+      bool lit = (rows[y / scale] >> (SCREEN_WIDTH - 1 - x / scale)) & 1;
+
+      if (grid && (x % scale == scale - 1 || y % scale == scale - 1))
+      {
+        out[y * width + x] = style->grid_color;
+      }
+      else
+      {
+        out[y * width + x] = lit ? style->on_color : style->off_color;
+      }
+    }
+  }
+}
+
+static uint64_t random_word(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/*
+Returns how many frames per second the kernel expands. A negative kernel
+times the per pixel reference instead.
+*/
+static double time_kernel(int kernel, const uint64_t rows[SCREEN_HEIGHT], int scale, const ScreenStyle *style,
+                          uint32_t *out)
+{
+  uint64_t frames = 0;
+  double start = seconds_now();
+  double elapsed = 0;
+
+  while (elapsed < BENCH_SECONDS)
+  {
+    for (int i = 0; i < 16; i++)
+    {
+      if (kernel < 0)
+      {
+        expand_per_pixel(rows, scale, style, out);
+      }
+      else
+      {
+        expand_screen_rgba_using(kernel, rows, scale, style, out);
+      }
+    }
+    frames += 16;
+    elapsed = seconds_now() - start;
+  }
+
+  return frames / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+  bool check_only = argc == 2 && strcmp(argv[1], "--check") == 0;
+  size_t max_pixels = (size_t)SCREEN_WIDTH * SCREEN_HEIGHT * BENCH_MAX_SCALE * BENCH_MAX_SCALE;
+  uint32_t *expected = malloc(max_pixels * sizeof expected[0]);
+  uint32_t *actual = malloc(max_pixels * sizeof actual[0]);
+  uint64_t rows[SCREEN_HEIGHT];
+  uint64_t seed = 0x9E3779B97F4A7C15ull;
+  int failures = 0;
+
+  if (expected == NULL || actual == NULL)
+  {
+    perror("Failed allocating the frames");
+    return 2;
+  }
+
+  ScreenStyle style = {
+      .on_color = RGBA_COLOR(0x12, 0x34, 0x56, 0xFF),
+      .off_color = RGBA_COLOR(0xFE, 0xDC, 0xBA, 0x98),
+      .grid_color = RGBA_COLOR(0x77, 0x00, 0x77, 0xFF),
+  };
+
+  for (int scale = 1; scale <= BENCH_MAX_SCALE; scale++)
+  {
+    for (int grid = 0; grid <= 1; grid++)
+    {
+      size_t pixels = (size_t)SCREEN_WIDTH * SCREEN_HEIGHT * scale * scale;
+
+      for (int i = 0; i < SCREEN_HEIGHT; i++)
+      {
+        rows[i] = random_word(&seed);
+      }
+      rows[0] = 0;
+      rows[1] = ~0ull;
+
+      style.grid = grid;
+      expand_per_pixel(rows, scale, &style, expected);
+
+      for (int kernel = RGBA_KERNEL_AUTO; kernel <= RGBA_KERNEL_AVX2; kernel++)
+      {
+        if (!rgba_kernel_available(kernel))
+        {
+          continue;
+        }
+
+        memset(actual, 0, pixels * sizeof actual[0]);
+        expand_screen_rgba_using(kernel, rows, scale, &style, actual);
+
+        if (memcmp(actual, expected, pixels * sizeof actual[0]) != 0)
+        {
+          printf("FAIL %s kernel at scale %d%s\n", kernel_names[kernel], scale, grid ? " with grid" : "");
+          failures++;
+        }
+      }
+    }
+  }
+
+  printf("%s: RGBA kernels %s\n", failures > 0 ? "FAIL" : "ok", failures > 0 ? "differ" : "match the reference");
+  if (check_only || failures > 0)
+  {
+    free(expected);
+    free(actual);
+    return failures > 0 ? 1 : 0;
+  }
+
+  style.grid = false;
+  printf("%-8s %12s", "scale", "per pixel");
+  for (int kernel = RGBA_KERNEL_SCALAR; kernel <= RGBA_KERNEL_AVX2; kernel++)
+  {
+    printf(" %12s", kernel_names[kernel]);
+  }
+  printf("   (frames/s)\n");
+
+  for (size_t i = 0; i < sizeof bench_scales / sizeof bench_scales[0]; i++)
+  {
+    int scale = bench_scales[i];
+
+    printf("%-8d %12.0f", scale, time_kernel(-1, rows, scale, &style, actual));
+    for (int kernel = RGBA_KERNEL_SCALAR; kernel <= RGBA_KERNEL_AVX2; kernel++)
+    {
+      if (rgba_kernel_available(kernel))
+      {
+        printf(" %12.0f", time_kernel(kernel, rows, scale, &style, actual));
+      }
+      else
+      {
+        printf(" %12s", "-");
+      }
+    }
+    printf("\n");
+  }
+
+  free(expected);
+  free(actual);
+  return 0;
+}
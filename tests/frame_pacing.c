@@ -0,0 +1,95 @@
+#include "chip8.h"
+#include <math.h>
+#include <stdio.h>
+
+/*
+Drives the --low-latency frame pacer with presents at common monitor refresh
+rates, with a little jitter, and checks the game still gets 60 emulated
+frames a second out of each. Run by `make test`.
+*/
+
+#define PACING_TEST_SECONDS 60
+// How far a present can land from its vsync, either way
+#define PACING_TEST_JITTER_SECONDS 0.0005
+
+static const double refresh_rates[] = {30, 50, 59.94, 60, 75, 120, 144, 165, 240};
+
+static uint32_t jitter_state = 1;
+
+static double jitter(void)
+{
+  jitter_state ^= jitter_state << 13;
+  jitter_state ^= jitter_state >> 17;
+  jitter_state ^= jitter_state << 5;
+  return ((double)jitter_state / UINT32_MAX * 2 - 1) * PACING_TEST_JITTER_SECONDS;
+}
+
+/*
+Presents at refresh_rate for PACING_TEST_SECONDS, starting at time 0.
+Returns the number of frames run. When the frame rate is a whole multiple of
+the refresh rate, every present should run the same number of frames, and
+uneven gets how many didn't.
+*/
+static uint64_t run_presents(double refresh_rate, double frame_rate, int *uneven)
+{
+  FramePacer pacer;
+  uint64_t frames = 0;
+  int presents = (int)(PACING_TEST_SECONDS * refresh_rate);
+  int frames_per_present = (int)round(frame_rate / refresh_rate);
+
+  frame_pacer_start(&pacer, 0);
+  *uneven = 0;
+
+  for (int i = 0; i < presents; i++)
+  {
+    int due = frame_pacer_due(&pacer, i / refresh_rate + jitter(), frame_rate);
+
+    frames += due;
+    // The first present only has the frame at time 0 to run
+    if (i > 0 && frames_per_present * refresh_rate == frame_rate && due != frames_per_present)
+    {
+      (*uneven)++;
+    }
+  }
+  return frames;
+}
+
+static int check_rate(double refresh_rate, double frame_rate)
+{
+  int uneven;
+  uint64_t frames = run_presents(refresh_rate, frame_rate, &uneven);
+  double frames_per_second = (double)frames / PACING_TEST_SECONDS;
+  // Within a present's worth of frames of the exact count
+  bool ok = fabs(frames - frame_rate * PACING_TEST_SECONDS) <= ceil(frame_rate / refresh_rate) && uneven == 0;
+
+  printf("%-4s %7.2f Hz presents: %8.3f frames/s, %d uneven presents\n", ok ? "ok" : "FAIL", refresh_rate,
+         frames_per_second, uneven);
+  return !ok;
+}
+
+int main(void)
+{
+  int failures = 0;
+
+  for (size_t i = 0; i < sizeof refresh_rates / sizeof refresh_rates[0]; i++)
+  {
+    failures += check_rate(refresh_rates[i], TIMER_HZ);
+  }
+  // Fast-forward is a higher frame rate on the same clock
+  failures += check_rate(144, TIMER_HZ * 8);
+
+  // A long stall drops the backlog instead of running it all at once, and
+  // counts what it dropped
+  FramePacer pacer;
+  frame_pacer_start(&pacer, 0);
+  frame_pacer_due(&pacer, 0, TIMER_HZ);
+  int after_stall = frame_pacer_due(&pacer, 2.0, TIMER_HZ);
+  bool stall_ok = after_stall == 1 && pacer.frames_dropped == 2 * TIMER_HZ - 1;
+
+  printf("%-4s 2 s stall: %d frames run, %llu dropped\n", stall_ok ? "ok" : "FAIL", after_stall,
+         (unsigned long long)pacer.frames_dropped);
+  failures += !stall_ok;
+
+  printf("%s: frame pacing\n", failures > 0 ? "FAIL" : "ok");
+  return failures > 0 ? 1 : 0;
+}
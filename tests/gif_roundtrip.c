@@ -0,0 +1,307 @@
+#include "chip8.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+Records random screens to a GIF with the real recorder, then decodes the
+file with a strict LZW decoder and checks every frame comes back pixel for
+pixel. Run by `make test`.
+
+The decoder rejects anything a lenient one would paper over: codes past the
+end of the table, data after the end code, a missing end code, and frames
+with too few or too many pixels.
+*/
+
+#define GIF_TEST_PATH "gif_roundtrip_test.gif"
+#define GIF_TEST_FRAMES 120
+// Same as RECORDER_GIF_SCALE in recorder.c
+#define GIF_TEST_SCALE 4
+#define GIF_TEST_WIDTH (SCREEN_WIDTH * GIF_TEST_SCALE)
+#define GIF_TEST_HEIGHT (SCREEN_HEIGHT * GIF_TEST_SCALE)
+
+// Each of these has a frame whose code table ends right at a code size
+// boundary (512 or 1024 entries), where the end code must be one bit wider
+static const uint32_t gif_test_seeds[] = {3, 12, 19};
+
+static uint64_t expected[GIF_TEST_FRAMES][SCREEN_HEIGHT];
+static uint8_t decoded[GIF_TEST_HEIGHT * GIF_TEST_WIDTH];
+
+static uint32_t random_word(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+typedef struct
+{
+  const uint8_t *data;
+  size_t size;
+  size_t position;
+  uint32_t bits;
+  int bit_count;
+} BitReader;
+
+static int read_code(BitReader *reader, int size)
+{
+  while (reader->bit_count < size)
+  {
+    if (reader->position == reader->size)
+    {
+      return -1;
+    }
+    reader->bits |= (uint32_t)reader->data[reader->position++] << reader->bit_count;
+    reader->bit_count += 8;
+  }
+
+  int code = reader->bits & ((1u << size) - 1);
+  reader->bits >>= size;
+  reader->bit_count -= size;
+  return code;
+}
+
+/*
+Decodes one frame's LZW data into decoded. Returns NULL on success, or what
+was wrong with it.
+*/
+static const char *lzw_decode(const uint8_t *data, size_t size, int min_code_size)
+{
+  static uint16_t prefix[4096];
+  static uint8_t suffix[4096];
+  static uint8_t string[4096];
+  static char error[64];
+
+  const int clear_code = 1 << min_code_size;
+  const int end_code = clear_code + 1;
+  BitReader reader = {data, size, 0, 0, 0};
+  int code_size = min_code_size + 1;
+  int next_code = end_code + 1;
+  int previous = -1;
+  size_t pixel_count = 0;
+
+  for (int i = 0; i < clear_code; i++)
+  {
+    suffix[i] = i;
+  }
+
+  for (;;)
+  {
+    int code = read_code(&reader, code_size);
+
+    if (code < 0)
+    {
+      return "no end code";
+    }
+    if (code == clear_code)
+    {
+      code_size = min_code_size + 1;
+      next_code = end_code + 1;
+      previous = -1;
+      continue;
+    }
+    if (code == end_code)
+    {
+      break;
+    }
+    if (code > next_code || (code == next_code && previous < 0))
+    {
+      snprintf(error, sizeof error, "bad code %d (table %d, size %d)", code, next_code, code_size);
+      return error;
+    }
+
+    // The string for code, or for previous plus its own first pixel
+    int length = 0;
+    int walk = code == next_code ? previous : code;
+    for (; walk >= clear_code; walk = prefix[walk])
+    {
+      string[length++] = suffix[walk];
+    }
+    string[length++] = walk;
+    uint8_t string_first = walk;
+
+    if (pixel_count + length + (code == next_code) > sizeof decoded)
+    {
+      return "too many pixels";
+    }
+    for (int i = length - 1; i >= 0; i--)
+    {
+      decoded[pixel_count++] = string[i];
+    }
+    if (code == next_code)
+    {
+      decoded[pixel_count++] = string_first;
+    }
+
+    if (previous >= 0 && next_code < 4096)
+    {
+      prefix[next_code] = previous;
+      suffix[next_code] = string_first;
+      next_code++;
+      if (next_code == (1 << code_size) && code_size < 12)
+      {
+        code_size++;
+      }
+    }
+    previous = code;
+  }
+
+  if (reader.position != size)
+  {
+    return "data after the end code";
+  }
+  if (pixel_count != sizeof decoded)
+  {
+    return "too few pixels";
+  }
+  return NULL;
+}
+
+/*
+Walks the GIF, decoding each frame and comparing it with expected. Returns
+the number of bad frames, or -1 if the file itself is broken.
+*/
+static int check_gif(const uint8_t *gif, size_t size, int frame_count)
+{
+  static uint8_t frame_data[1 << 20];
+  size_t position = 13 + 12; // Header, screen descriptor and 4 color table
+  int frame = 0;
+  int failures = 0;
+
+  if (size < position || memcmp(gif, "GIF89a", 6) != 0)
+  {
+    return -1;
+  }
+
+  while (position < size && gif[position] != 0x3B)
+  {
+    if (gif[position] == 0x21)
+    {
+      // Extension: label, then sub-blocks
+      position += 2;
+      while (position < size && gif[position] != 0)
+      {
+        position += gif[position] + 1;
+      }
+      position++;
+      continue;
+    }
+
+    if (gif[position] != 0x2C || position + 11 > size)
+    {
+      return -1;
+    }
+
+    int min_code_size = gif[position + 10];
+    size_t data_size = 0;
+    position += 11;
+    while (position < size && gif[position] != 0)
+    {
+      memcpy(frame_data + data_size, gif + position + 1, gif[position]);
+      data_size += gif[position];
+      position += gif[position] + 1;
+    }
+    position++;
+
+    const char *error = lzw_decode(frame_data, data_size, min_code_size);
+    if (error == NULL && frame < frame_count)
+    {
+      for (int y = 0; y < GIF_TEST_HEIGHT && error == NULL; y++)
+      {
+        for (int x = 0; x < GIF_TEST_WIDTH; x++)
+        {
+          int lit = (expected[frame][y / GIF_TEST_SCALE] >> (SCREEN_WIDTH - 1 - x / GIF_TEST_SCALE)) & 1;
+          if (decoded[y * GIF_TEST_WIDTH + x] != lit)
+          {
+            error = "wrong pixels";
+            break;
+          }
+        }
+      }
+    }
+
+    if (error != NULL)
+    {
+      printf("     frame %d: %s\n", frame, error);
+      failures++;
+    }
+    frame++;
+  }
+
+  if (frame != frame_count)
+  {
+    printf("     %d frames in the GIF, %d recorded\n", frame, frame_count);
+    failures++;
+  }
+  return failures;
+}
+
+static int record_and_check(uint32_t seed)
+{
+  const struct timespec writer_time = {0, 1000000};
+
+  if (recorder_start(GIF_TEST_PATH) != 0)
+  {
+    return -1;
+  }
+
+  for (int frame = 0; frame < GIF_TEST_FRAMES; frame++)
+  {
+    // A different density each frame, so the code tables end up all sizes
+    uint32_t density = random_word(&seed) % 64;
+
+    for (int y = 0; y < SCREEN_HEIGHT; y++)
+    {
+      expected[frame][y] = 0;
+      for (int x = 0; x < SCREEN_WIDTH; x++)
+      {
+        pixels[y][x] = random_word(&seed) % 256 < density;
+        expected[frame][y] = expected[frame][y] << 1 | pixels[y][x];
+      }
+    }
+    // Make sure no two frames in a row are the same, or the recorder skips one
+    pixels[0][0] = frame & 1;
+    expected[frame][0] = (expected[frame][0] & ~(1ull << (SCREEN_WIDTH - 1))) | (uint64_t)(frame & 1) << (SCREEN_WIDTH - 1);
+
+    recorder_capture(frame);
+    // Give the writer time, so the queue never fills up and drops a frame
+    nanosleep(&writer_time, NULL);
+  }
+  recorder_stop();
+
+  FILE *file = fopen(GIF_TEST_PATH, "rb");
+  if (file == NULL)
+  {
+    perror(GIF_TEST_PATH);
+    return -1;
+  }
+
+  static uint8_t gif[64 << 20];
+  size_t size = fread(gif, 1, sizeof gif, file);
+  fclose(file);
+  unlink(GIF_TEST_PATH);
+
+  return check_gif(gif, size, GIF_TEST_FRAMES);
+}
+
+int main(void)
+{
+  int failures = 0;
+
+  for (size_t i = 0; i < sizeof gif_test_seeds / sizeof gif_test_seeds[0]; i++)
+  {
+    int result = record_and_check(gif_test_seeds[i]);
+
+    if (result != 0)
+    {
+      printf("FAIL seed %u%s\n", gif_test_seeds[i], result < 0 ? ": broken file" : "");
+      failures++;
+    }
+  }
+
+  printf("%s: GIF recordings %s\n", failures > 0 ? "FAIL" : "ok", failures > 0 ? "don't round-trip" : "round-trip");
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,434 @@
+#include "chip8.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+Conformance tests for the core, run by `make test`.
+
+Each line of the manifest names a test ROM (relative to the manifest), how
+many cycles to run it for and the expected hash of the machine state
+afterwards, then its speed. A test fails if the hash is off, or if running
+the ROM one instruction at a time, with idle-loop fast-forwarding off, ends up
+anywhere other than the fast path did, or if halt detection stops the ROM
+before it's done, or if it runs at less than half its recorded speed.
+
+Speeds are relative to a reference loop timed on the same host right around
+the ROM, not in cycles per second, so one manifest holds on fast and slow
+machines alike, and a busy machine slows both down together.
+
+`--record` runs everything and rewrites the manifest with the current hashes
+and speeds, for when a change in behaviour or speed is intended. `--bench`
+only reports each ROM's cycles per second and speed, for `make bench`.
+
+ROMs ending in .hex are text: pairs of hex digits, with ; starting a
+comment. Anything else is loaded as a binary ROM.
+*/
+
+#define TEST_MAX_TESTS 64
+#define TEST_LINE_SIZE 512
+// How long each ROM, and the reference loop, run to measure their speed
+#define TEST_BENCH_SECONDS 0.25
+// Taken in turns, so a change in the machine's load hits both about equally
+#define TEST_BENCH_ROUNDS 5
+// Recorded speeds leave this much headroom for noise the reference doesn't cancel
+#define TEST_SPEED_FRACTION 0.5
+
+typedef struct
+{
+  char rom[256];
+  uint64_t cycles;
+  uint64_t expected_hash;
+  // Cycles per second over the reference loop's steps per second, 0 if unknown
+  double speed;
+} TestCase;
+
+static char manifest_lines[TEST_MAX_TESTS * 2][TEST_LINE_SIZE];
+static int manifest_line_count = 0;
+// For each manifest line, the test it holds, or -1 for comments
+static int line_tests[TEST_MAX_TESTS * 2];
+static TestCase tests[TEST_MAX_TESTS];
+static int test_count = 0;
+
+static double seconds_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+The reference loop: a chain of dependent multiplies and xors, a fixed amount
+of plain integer work for the ROMs' speeds to be measured against. Returns
+millions of steps per second.
+*/
+static volatile uint64_t reference_result;
+
+static double reference_rate(double seconds)
+{
+  uint64_t hash = 0;
+  uint64_t steps = 0;
+  double start = seconds_now();
+  double elapsed = 0;
+
+  while (elapsed < seconds)
+  {
+    for (int i = 0; i < 100000; i++)
+    {
+      hash = (hash ^ i) * 0x100000001B3ull;
+    }
+    steps += 100000;
+    elapsed = seconds_now() - start;
+  }
+
+  reference_result = hash;
+  return steps / elapsed / 1e6;
+}
+
+/*
+Runs the ROM loaded in snapshot over and over from the start. Returns
+millions of cycles per second.
+*/
+static double rom_rate(const MachineSnapshot *snapshot, uint64_t cycles, double seconds)
+{
+  uint64_t total_cycles = 0;
+  double start = seconds_now();
+  double elapsed = 0;
+
+  while (elapsed < seconds)
+  {
+    restore_machine(snapshot);
+    run_cycles(cycles);
+    total_cycles += cycles;
+    elapsed = seconds_now() - start;
+  }
+
+  return total_cycles / elapsed / 1e6;
+}
+
+/*
+Measures the ROM loaded in snapshot against the reference loop. Returns its
+speed, and its millions of cycles per second in mhz.
+*/
+static double measure_speed(const MachineSnapshot *snapshot, uint64_t cycles, double *mhz)
+{
+  double rom_total = 0;
+  double reference_total = 0;
+
+  for (int round = 0; round < TEST_BENCH_ROUNDS; round++)
+  {
+    reference_total += reference_rate(TEST_BENCH_SECONDS / TEST_BENCH_ROUNDS);
+    rom_total += rom_rate(snapshot, cycles, TEST_BENCH_SECONDS / TEST_BENCH_ROUNDS);
+  }
+
+  *mhz = rom_total / TEST_BENCH_ROUNDS;
+  return rom_total / reference_total;
+}
+
+/*
+FNV-1a over everything a ROM can observe or change, except cycle_count.
+*/
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+  const uint8_t *bytes = data;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 0x100000001B3ull;
+  }
+
+  return hash;
+}
+
+static uint64_t hash_machine(void)
+{
+  uint64_t rows[SCREEN_HEIGHT];
+  uint64_t hash = 0xCBF29CE484222325ull;
+
+  pack_screen(rows);
+  hash = hash_bytes(hash, rows, sizeof rows);
+  hash = hash_bytes(hash, ram, sizeof ram);
+  hash = hash_bytes(hash, registers, sizeof registers);
+  hash = hash_bytes(hash, stack, sizeof stack);
+  hash = hash_bytes(hash, &stack_pointer, sizeof stack_pointer);
+  hash = hash_bytes(hash, &pc, sizeof pc);
+  hash = hash_bytes(hash, &I, sizeof I);
+  hash = hash_bytes(hash, &delay_timer, sizeof delay_timer);
+  hash = hash_bytes(hash, &sound_timer, sizeof sound_timer);
+
+  return hash;
+}
+
+/*
+Runs the ROM loaded in snapshot for the given cycles, into result. With
+slow_path set, an unreachable breakpoint arms the debugger, which turns off
+idle-loop fast-forwarding.
+*/
+static void run_from(const MachineSnapshot *snapshot, uint64_t cycles, bool slow_path, MachineSnapshot *result)
+{
+  restore_machine(snapshot);
+  set_breakpoint(0xFFE, slow_path);
+  run_cycles(cycles);
+  set_breakpoint(0xFFE, false);
+
+  // Zeroed first so the padding compares equal too
+  memset(result, 0, sizeof *result);
+  save_machine(result);
+}
+
+/*
+Runs the ROM loaded in snapshot for the given cycles with halt detection on.
+The test ROMs that stop at all end in a fixed point, so a halt is only right
+if the machine is already in the state the full run ends in, expected_hash.
+Returns whether it was, or didn't halt at all.
+*/
+static bool halt_was_right(const MachineSnapshot *snapshot, uint64_t cycles, uint64_t expected_hash)
+{
+  restore_machine(snapshot);
+  halt_detection = true;
+  run_cycles(cycles);
+  halt_detection = false;
+
+  return !machine_halted || hash_machine() == expected_hash;
+}
+
+/*
+Loads a .hex text ROM into RAM at ROM_START_ADDRESS. Returns 0 on success.
+*/
+static int load_hex_rom(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+
+  char line[TEST_LINE_SIZE];
+  int address = ROM_START_ADDRESS;
+
+  while (fgets(line, sizeof line, file) != NULL)
+  {
+    char *comment = strchr(line, ';');
+    if (comment != NULL)
+    {
+      *comment = '\0';
+    }
+
+    for (char *p = line; *p != '\0'; p++)
+    {
+      if (isspace((unsigned char)*p))
+      {
+        continue;
+      }
+
+      unsigned int byte;
+      if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]) ||
+          sscanf(p, "%2x", &byte) != 1 || address >= RAM_SIZE)
+      {
+        fprintf(stderr, "%s: bad byte \"%.2s\"\n", path, p);
+        fclose(file);
+        return 1;
+      }
+
+      ram[address++] = byte;
+      p++;
+    }
+  }
+
+  fclose(file);
+  return 0;
+}
+
+static int load_test_rom(const char *manifest, const char *rom)
+{
+  char path[1024];
+  const char *slash = strrchr(manifest, '/');
+  int directory_length = slash != NULL ? (int)(slash - manifest + 1) : 0;
+
+  if (snprintf(path, sizeof path, "%.*s%s", directory_length, manifest, rom) >= (int)sizeof path)
+  {
+    fprintf(stderr, "%s: path too long\n", rom);
+    return 1;
+  }
+
+  size_t length = strlen(path);
+  if (length > 4 && strcmp(path + length - 4, ".hex") == 0)
+  {
+    return load_hex_rom(path);
+  }
+
+  return load_rom_to_ram(path);
+}
+
+static int read_manifest(const char *manifest)
+{
+  FILE *file = fopen(manifest, "r");
+  if (file == NULL)
+  {
+    perror(manifest);
+    return 1;
+  }
+
+  while (manifest_line_count < TEST_MAX_TESTS * 2 &&
+         fgets(manifest_lines[manifest_line_count], TEST_LINE_SIZE, file) != NULL)
+  {
+    char *line = manifest_lines[manifest_line_count];
+    TestCase *test = &tests[test_count];
+    char hash[32] = "-";
+
+    line_tests[manifest_line_count] = -1;
+
+    if (line[0] != '#' && test_count < TEST_MAX_TESTS &&
+        sscanf(line, "%255s %llu %31s %lf", test->rom, (unsigned long long *)&test->cycles, hash, &test->speed) >= 2)
+    {
+      test->expected_hash = strtoull(hash, NULL, 16);
+      line_tests[manifest_line_count] = test_count++;
+    }
+
+    manifest_line_count++;
+  }
+
+  fclose(file);
+  return 0;
+}
+
+static int write_manifest(const char *manifest)
+{
+  FILE *file = fopen(manifest, "w");
+  if (file == NULL)
+  {
+    perror(manifest);
+    return 1;
+  }
+
+  for (int i = 0; i < manifest_line_count; i++)
+  {
+    if (line_tests[i] < 0)
+    {
+      fputs(manifest_lines[i], file);
+      continue;
+    }
+
+    TestCase *test = &tests[line_tests[i]];
+    fprintf(file, "%-18s %8llu %016llx %8.3f\n", test->rom, (unsigned long long)test->cycles,
+            (unsigned long long)test->expected_hash, test->speed);
+  }
+
+  fclose(file);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  bool record = argc == 3 && strcmp(argv[1], "--record") == 0;
+  bool bench = argc == 3 && strcmp(argv[1], "--bench") == 0;
+  const char *manifest = argv[argc - 1];
+
+  if (argc != 2 && !record && !bench)
+  {
+    fprintf(stderr, "Usage: chip8_tests [--record | --bench] <manifest>\n");
+    return 2;
+  }
+
+  if (read_manifest(manifest) != 0)
+  {
+    return 2;
+  }
+
+  MachineSnapshot loaded;
+  static MachineSnapshot fast_result;
+  static MachineSnapshot slow_result;
+  int failures = 0;
+
+  for (int i = 0; i < test_count; i++)
+  {
+    TestCase *test = &tests[i];
+
+    // After the ROM before it, so this also checks the reset leaves nothing behind
+    reset_machine();
+    if (load_test_rom(manifest, test->rom) != 0)
+    {
+      return 2;
+    }
+    save_machine(&loaded);
+
+    double mhz;
+    double speed = measure_speed(&loaded, test->cycles, &mhz);
+
+    if (bench)
+    {
+      printf("%-18s %10.1f Mcycles/s %8.3f speed (recorded %.3f)\n", test->rom, mhz, speed, test->speed);
+      continue;
+    }
+
+    run_from(&loaded, test->cycles, true, &slow_result);
+    run_from(&loaded, test->cycles, false, &fast_result);
+    uint64_t hash = hash_machine();
+    bool paths_ok = memcmp(&fast_result, &slow_result, sizeof fast_result) == 0;
+
+    if (record)
+    {
+      test->expected_hash = hash;
+      test->speed = speed;
+      printf("recorded %-18s %016llx %10.1f Mcycles/s %8.3f speed\n", test->rom, (unsigned long long)hash, mhz,
+             speed);
+      continue;
+    }
+
+    bool hash_ok = hash == test->expected_hash;
+    bool speed_ok = speed >= test->speed * TEST_SPEED_FRACTION;
+    bool halt_ok = halt_was_right(&loaded, test->cycles, hash);
+    ADDRESS halted_at = halt_pc;
+    restore_machine(&fast_result);
+
+    printf("%-4s %-18s %016llx %10.1f Mcycles/s %8.3f speed\n",
+           hash_ok && paths_ok && halt_ok && speed_ok ? "ok" : "FAIL", test->rom, (unsigned long long)hash, mhz,
+           speed);
+
+    if (!hash_ok)
+    {
+      printf("     expected hash %016llx, V0-VF:", (unsigned long long)test->expected_hash);
+      for (int r = 0; r < 16; r++)
+      {
+        printf(" %02X", registers[r]);
+      }
+      printf(" I: %03X PC: %03X\n", I, pc);
+    }
+
+    if (!paths_ok)
+    {
+      printf("     fast-forwarded run differs from the one instruction at a time run\n");
+    }
+
+    if (!halt_ok)
+    {
+      printf("     halt detection stopped it at 0x%03X, but it wasn't done\n", halted_at);
+    }
+
+    if (!speed_ok)
+    {
+      printf("     slower than half its recorded speed of %.3f\n", test->speed);
+    }
+
+    failures += !(hash_ok && paths_ok && halt_ok && speed_ok);
+  }
+
+  if (record)
+  {
+    return write_manifest(manifest) != 0 ? 2 : 0;
+  }
+  if (bench)
+  {
+    return 0;
+  }
+
+  printf("%d of %d tests passed\n", test_count - failures, test_count);
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,116 @@
+#include "chip8.h"
+#include "shm_export.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+Reads the --shm segment the way shm_export.h tells external processes to,
+while another thread publishes frames as fast as it can, and checks that
+every copy it gets is a whole frame. Run by `make test`.
+
+Every frame the writer sets all the registers to the low byte of its number
+and cycle_count to the number itself, so a torn copy shows up as registers
+that disagree with each other or with the frame count.
+*/
+
+#define SHM_TEST_NAME "/chip8-shm-reader-test"
+#define SHM_TEST_FRAMES 200000
+
+static atomic_bool writer_done = false;
+
+static void *write_frames(void *arg)
+{
+  (void)arg;
+
+  for (uint64_t frame = 1; frame <= SHM_TEST_FRAMES; frame++)
+  {
+    memset(registers, (BYTE)frame, sizeof registers);
+    cycle_count = frame;
+    shm_export_publish();
+  }
+
+  atomic_store(&writer_done, true);
+  return NULL;
+}
+
+int main(void)
+{
+  if (shm_export_open(SHM_TEST_NAME, 1) != 0)
+  {
+    return 2;
+  }
+
+  int fd = shm_open(SHM_TEST_NAME, O_RDWR, 0);
+  struct stat size;
+
+  if (fd < 0 || fstat(fd, &size) != 0)
+  {
+    perror("Failed opening the segment as a reader");
+    return 2;
+  }
+
+  Chip8SharedState *state = mmap(NULL, size.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (state == MAP_FAILED)
+  {
+    perror("Failed mapping the segment as a reader");
+    return 2;
+  }
+
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, write_frames, NULL) != 0)
+  {
+    perror("Failed starting the writer");
+    return 2;
+  }
+
+  uint64_t reads = 0;
+  uint64_t torn = 0;
+  uint64_t last_frame = 0;
+
+  while (!atomic_load(&writer_done))
+  {
+    uint8_t copied_registers[16];
+    uint64_t frame;
+    uint64_t copied_cycle_count;
+
+    for (;;)
+    {
+      uint32_t start = atomic_load_explicit(&state->sequence, memory_order_acquire);
+      if (start & 1)
+      {
+        continue;
+      }
+      memcpy(copied_registers, state->registers, sizeof copied_registers);
+      frame = state->frame;
+      copied_cycle_count = state->cycle_count;
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&state->sequence, memory_order_relaxed) == start)
+      {
+        break;
+      }
+    }
+
+    bool whole = frame == copied_cycle_count && frame >= last_frame;
+    for (int i = 0; i < 16; i++)
+    {
+      whole = whole && copied_registers[i] == (BYTE)frame;
+    }
+
+    torn += !whole;
+    last_frame = frame;
+    reads++;
+  }
+
+  pthread_join(writer, NULL);
+  munmap(state, size.st_size);
+  shm_export_close();
+
+  printf("%s: %llu shared memory reads, %llu torn\n", torn > 0 ? "FAIL" : "ok", (unsigned long long)reads,
+         (unsigned long long)torn);
+  return torn > 0 ? 1 : 0;
+}